@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // strcasestr, memrchr, asprintf
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -9,6 +10,29 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 const char * sysname = "seashell";
 
 // Group Members: Burcu Özer (64535), Sedat Çoban (60545)
@@ -24,6 +48,7 @@ struct command_t {
 	bool auto_complete;
 	int arg_count;
 	char **args;
+	char *quotes; // quote character that wrapped each argument, 0 if none
 	char *redirects[3]; // in/out redirection
 	struct command_t *next; // for piping
 };
@@ -58,12 +83,10 @@ void print_command(struct command_t * command)
  */
 int free_command(struct command_t *command)
 {
-	if (command->arg_count)
-	{
-		for (int i=0; i<command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
+	for (int i=0; i<command->arg_count; ++i)
+		free(command->args[i]);
+	free(command->args);
+	free(command->quotes);
 	for (int i=0;i<3;++i)
 		if (command->redirects[i])
 			free(command->redirects[i]);
@@ -88,6 +111,57 @@ int show_prompt()
 	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
 	return 0;
 }
+//open quotes and command substitutions while scanning a word
+struct word_state {
+	char quote; // quote character still open, 0 if none
+	int depth; // command substitutions still open
+};
+/**
+ * Advances the word state over s
+ */
+void word_scan(const char *s, size_t len, struct word_state *state)
+{
+	for (size_t i=0;i<len;++i)
+	{
+		if (state->quote)
+		{
+			if (s[i]==state->quote)
+				state->quote=0;
+		}
+		else if (s[i]=='"' || s[i]=='\'')
+			state->quote=s[i];
+		else if (s[i]=='$' && i+1<len && s[i+1]=='(')
+		{
+			state->depth++;
+			i++;
+		}
+		else if (state->depth>0 && s[i]=='(')
+			state->depth++;
+		else if (state->depth>0 && s[i]==')')
+			state->depth--;
+	}
+}
+/**
+ * Extends a strtok token over the following ones until its quotes and command substitutions are
+ * closed, so "a b" and $(ls | wc -l) stay one word with their blanks, pipes and redirects
+ * @return length of the extended token
+ */
+size_t parse_rejoin(char *token, const char *splitters)
+{
+	size_t len=strlen(token);
+	struct word_state state={0, 0};
+	word_scan(token, len, &state);
+	while (state.quote || state.depth>0)
+	{
+		char *next=strtok(NULL, splitters);
+		if (!next)
+			break;
+		token[len]=' '; // where strtok ended the previous token
+		word_scan(next, strlen(next), &state);
+		len=next+strlen(next)-token;
+	}
+	return len;
+}
 /**
  * Parse a command string into a command struct
  * @param  buf     [description]
@@ -110,28 +184,31 @@ int parse_command(char *buf, struct command_t *command)
 	if (len>0 && buf[len-1]=='?') // auto-complete
 		command->auto_complete=true;
 	if (len>0 && buf[len-1]=='&') // background
+	{
 		command->background=true;
+		buf[--len]=0; // "ls&" runs ls
+		while (len>0 && strchr(splitters, buf[len-1])!=NULL)
+			buf[--len]=0;
+	}
 
+	char *line_end=buf+len;
 	char *pch = strtok(buf, splitters);
-	command->name=(char *)malloc(strlen(pch)+1);
-	if (pch==NULL)
-		command->name[0]=0;
-	else
-		strcpy(command->name, pch);
+	if (pch)
+		parse_rejoin(pch, splitters);
+	command->name=strdup(pch ? pch : ""); // an empty line has no name
 
 	command->args=(char **)malloc(sizeof(char *));
 
 	int redirect_index;
 	int arg_index=0;
-	char temp_buf[1024], *arg;
+	char *arg;
 	while (1)
 	{
-		// tokenize input on splitters
+		// tokenize input on splitters, arguments are edited in place in buf
 		pch = strtok(NULL, splitters);
 		if (!pch) break;
-		arg=temp_buf;
-		strcpy(arg, pch);
-		len=strlen(arg);
+		arg=pch;
+		len=parse_rejoin(arg, splitters);
 
 		if (len==0) continue; // empty arg, go for next
 		while (len>0 && strchr(splitters, arg[0])!=NULL) // trim left whitespace
@@ -145,8 +222,10 @@ int parse_command(char *buf, struct command_t *command)
 		// piping to another command
 		if (strcmp(arg, "|")==0)
 		{
-			struct command_t *c=malloc(sizeof(struct command_t));
 			int l=strlen(pch);
+			if (pch+l>=line_end) // nothing after the pipe
+				break;
+			struct command_t *c=calloc(1, sizeof(struct command_t));
 			pch[l]=splitters[0]; // restore strtok termination
 			index=1;
 			while (pch[index]==' ' || pch[index]=='\t') index++; // skip whitespaces
@@ -154,7 +233,7 @@ int parse_command(char *buf, struct command_t *command)
 			parse_command(pch+index, c);
 			pch[l]=0; // put back strtok termination
 			command->next=c;
-			continue;
+			break; // the rest of the line belongs to the next command
 		}
 
 		// background process
@@ -177,19 +256,26 @@ int parse_command(char *buf, struct command_t *command)
 		}
 		if (redirect_index != -1)
 		{
-			command->redirects[redirect_index]=malloc(len);
-			strcpy(command->redirects[redirect_index], arg+1);
+			const char *target=arg+1;
+			if (target[0]==0 && (target=strtok(NULL, splitters))==NULL) // "> file"
+				target="";
+			free(command->redirects[redirect_index]);
+			command->redirects[redirect_index]=strdup(target);
 			continue;
 		}
 
 		// normal arguments
-		if (len>2 && ((arg[0]=='"' && arg[len-1]=='"')
+		char quote=0;
+		if (len>=2 && ((arg[0]=='"' && arg[len-1]=='"')
 			|| (arg[0]=='\'' && arg[len-1]=='\''))) // quote wrapped arg
 		{
+			quote=arg[0];
 			arg[--len]=0;
 			arg++;
 		}
 		command->args=(char **)realloc(command->args, sizeof(char *)*(arg_index+1));
+		command->quotes=realloc(command->quotes, arg_index+1);
+		command->quotes[arg_index]=quote; // expansion leaves single quoted words alone
 		command->args[arg_index]=(char *)malloc(len+1);
 		strcpy(command->args[arg_index++], arg);
 	}
@@ -208,12 +294,18 @@ void prompt_backspace()
  * @param  buf_size [description]
  * @return          [description]
  */
+void event_wait_input(const char *line, int length);
+const char *history_recall(int age, size_t *len);
+//terminal settings around the prompt, so commands run while it waits for a key get the cooked ones back
+struct termios prompt_cooked_termios, prompt_raw_termios;
+bool prompt_raw_mode=false;
 int prompt(struct command_t *command)
 {
 	int index=0;
-	char c;
+	int c;
 	char buf[4096];
-	static char oldbuf[4096];
+	char typed[4096]=""; // the line being typed while history entries are shown
+	int recall=0; // entries walked back with the up arrow, 0 for the typed line
 
     // tcgetattr gets the parameters of the current terminal
     // STDIN_FILENO will tell tcgetattr that it should write the settings
@@ -227,6 +319,9 @@ int prompt(struct command_t *command)
     // Those new settings will be set to STDIN
     // TCSANOW tells tcsetattr to change attributes immediately.
     tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    prompt_cooked_termios=backup_termios;
+    prompt_raw_termios=new_termios;
+    prompt_raw_mode=true;
 
 
     //FIXME: backspace is applied before printing chars
@@ -235,7 +330,15 @@ int prompt(struct command_t *command)
 	buf[0]=0;
   	while (1)
   	{
+		//background jobs, scheduled jobs and history updates are handled while waiting for a key
+		event_wait_input(buf, index);
 		c=getchar();
+		if (c==EOF) // end of input
+		{
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			prompt_raw_mode=false;
+			return EXIT;
+		}
 		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
 
 		if (c==9) // handle tab
@@ -263,20 +366,35 @@ int prompt(struct command_t *command)
 			multicode_state=2;
 			continue;
 		}
-		if (c==65 && multicode_state==2) // up arrow
+		if ((c==65 || c==66) && multicode_state==2) // up and down arrows walk the recent history entries
 		{
-			int i;
+			multicode_state=0;
+			int age=recall+(c==65 ? 1 : -1);
+			size_t len;
+			const char *line=age>0 ? history_recall(age, &len) : NULL;
+			if (age<0 || (age>0 && !line)) // nothing older, or already on the typed line
+				continue;
+			if (recall==0) // the typed line comes back when going down again
+			{
+				buf[index]=0;
+				snprintf(typed, sizeof(typed), "%s", buf);
+			}
+			if (age==0)
+			{
+				line=typed;
+				len=strlen(typed);
+			}
+			recall=age;
+			if (len>sizeof(buf)-2)
+				len=sizeof(buf)-2;
 			while (index>0)
 			{
 				prompt_backspace();
 				index--;
 			}
-			for (i=0;oldbuf[i];++i)
-			{
-				putchar(oldbuf[i]);
-				buf[i]=oldbuf[i];
-			}
-			index=i;
+			memcpy(buf, line, len);
+			fwrite(buf, 1, len, stdout);
+			index=len;
 			continue;
 		}
 		else
@@ -284,854 +402,7317 @@ int prompt(struct command_t *command)
 
 		putchar(c); // echo the character
 		buf[index++]=c;
-		if (index>=sizeof(buf)-1) break;
+		if (index>=(int)sizeof(buf)-1) break;
 		if (c=='\n') // enter key
 			break;
 		if (c==4) // Ctrl+D
+		{
+			prompt_raw_mode=false;
 			return EXIT;
+		}
   	}
   	if (index>0 && buf[index-1]=='\n') // trim newline from the end
   		index--;
   	buf[index++]=0; // null terminate string
 
-  	strcpy(oldbuf, buf);
-
   	parse_command(buf, command);
 
   	// print_command(command); // DEBUG: uncomment for debugging
 
     // restore the old settings
     tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+    prompt_raw_mode=false;
   	return SUCCESS;
 }
-int process_command(struct command_t *command);
-int main()
-{
-	while (1)
-	{
-		struct command_t *command=malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-		int code;
-		code = prompt(command);
-		if (code==EXIT) break;
 
-		code = process_command(command);
-		if (code==EXIT) break;
+//shell options toggled with the shopt builtin
+struct shell_option {
+	const char *name;
+	bool enabled;
+	const char *help;
+};
+struct shell_option shell_options[] = {
+	{"histdedup", false, "do not record a command identical to the previous history entry"},
+	{"fastutils", false, "run cat, wc, head and tail inside the shell instead of the external commands"},
+	{"bgbuffer", false, "keep background job output for jobs output instead of printing it above the prompt"},
+};
+#define SHELL_OPTION_COUNT ((int)(sizeof(shell_options)/sizeof(shell_options[0])))
+/**
+ * Returns whether the named shell option is on
+ * @param  name option name
+ * @return      true if enabled
+ */
+bool shopt_enabled(const char *name)
+{
+	for (int i=0;i<SHELL_OPTION_COUNT;++i)
+		if (strcmp(shell_options[i].name, name)==0)
+			return shell_options[i].enabled;
+	return false;
+}
 
-		free_command(command);
+/**
+ * Takes an advisory lock on a lock file, creating it if needed
+ * @param  path      lock file path
+ * @param  operation LOCK_EX or LOCK_SH, optionally with LOCK_NB
+ * @return           descriptor to pass to unlock_file, -1 if the lock was not taken
+ */
+int lock_file(const char *path, int operation)
+{
+	int fd=open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd==-1)
+		return -1;
+	if (flock(fd, operation)==-1)
+	{
+		close(fd);
+		return -1;
 	}
+	return fd;
+}
+void unlock_file(int fd)
+{
+	if (fd!=-1)
+		close(fd); // closing the descriptor releases the flock
+}
+/**
+ * Builds the path of a file in the home directory
+ */
+void home_path(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s/%s", getenv("HOME"), name);
+}
 
-	printf("\n");
-	return 0;
+//growable output buffer, also filled by pool workers and written out by the shell thread
+struct out_buf {
+	char *data;
+	size_t len, capacity;
+};
+void out_append(struct out_buf *out, const char *s, size_t len)
+{
+	if (out->len+len>out->capacity)
+	{
+		out->capacity=(out->len+len)*2;
+		out->data=realloc(out->data, out->capacity);
+	}
+	memcpy(out->data+out->len, s, len);
+	out->len+=len;
+}
+void out_puts(struct out_buf *out, const char *s)
+{
+	out_append(out, s, strlen(s));
 }
 
-int process_command(struct command_t *command)
+//structured output for --json and --ndjson: records are serialized by hand into a large buffer that
+//is written out in blocks, with no printf per field. --json prints one array of records, --ndjson one
+//record per line. Records built elsewhere, e.g. by pool workers, are kept one per line in their own
+//buffer and framed when they are written.
+enum json_mode {JSON_OFF, JSON_ARRAY, JSON_LINES};
+#define JSON_BUFFER (256*1024) // written out once this much is buffered
+#define JSON_DEPTH 8 // deepest nesting, json_open asserts it is not exceeded
+struct json_out {
+	struct out_buf *out;
+	int depth;
+	bool first[JSON_DEPTH]; // nothing written yet inside the object or array at this depth
+};
+/**
+ * Writes the separator before a member and its key, NULL inside arrays
+ */
+void json_key(struct json_out *json, const char *key)
 {
-	//creates file to store history
-        char path_history[256];
-	strcpy(path_history, getenv("HOME"));
-	strcat(path_history, "/history.txt");
-	FILE *fhistory = fopen(path_history, "ab");
-	if (fhistory == NULL)
+	if (json->depth>0)
 	{
-    		printf("Error: Could not open the file\n");
-    		exit(1);
+		if (!json->first[json->depth-1])
+			out_append(json->out, ",", 1);
+		json->first[json->depth-1]=false;
 	}
-	
-	//hist implementation (part VI)
-	//gets the local time
-	time_t local_time;
- 	struct tm * time_struct;
- 	time(&local_time);
- 	time_struct = localtime (&local_time);
- 	char time_array[256] = {0};
- 	strftime(time_array, 256, "%d/%m/%Y %a %X", time_struct); //stores the date, day info
-	char history_line[256];
-	//stores user, date and command info into a string
-	strcpy(history_line, getenv("USER")); 
-	strcat(history_line, " ");
-	strcat(history_line, time_array);
-	strcat(history_line, " ");
-	strcat(history_line, command->name);
-	strcat(history_line, " ");
-	for (int i = 0; i <command->arg_count; i++){
-		strcat(history_line, command->args[i]);
-		strcat(history_line, " ");
+	if (key)
+	{
+		out_append(json->out, "\"", 1);
+		out_puts(json->out, key); // keys are plain names
+		out_append(json->out, "\":", 2);
 	}
-	//prints the history_line to the file
-	fprintf(fhistory, "%s\n", history_line);
-	fclose(fhistory);
-	//creates hist implementation 
-	if (strcmp(command->name, "hist")==0)
-   	{
-        	if (command->arg_count > 0)
-        	{	
-        		//opens history file
-        		fhistory = fopen(path_history, "r");
-        		//prints all the history
-			if (strcmp(command->args[0], "all")==0){
-				char line[256];
-		    		while (fscanf(fhistory,"%[^\n]\n", line) != EOF) 
-		    		{ 
-		  			printf("%s\n", line); 
-		   		}
-		   	//prints the history of the given user 
-		   	}else if (strcmp(command->args[0], "user")==0){
-				char line[256];
-		    		while (fscanf(fhistory,"%[^\n]\n", line) != EOF) 
-		    		{ 
-		  			char all_line[256];
-		    			strcpy(all_line, line);
-			    		char * word = strtok(line, " ");
-			    		if(strcmp(word, command->args[1])==0){
-			    			printf("%s\n", all_line); 
-			  		}
-		   		} 
-		   	//prints the history of the given date	
-		   	}else if (strcmp(command->args[0], "date")==0){
-				char line[256];
-	    			while (fscanf(fhistory,"%[^\n]\n", line) != EOF) 
-	    			{ 	
-		    			char all_line[256];
-		    			strcpy(all_line, line);
-			    		char * word = strtok(line, " ");
-			 		word = strtok(NULL, " ");
-			    		if(strcmp(word, command->args[1])==0){
-			    			printf("%s\n", all_line); 
-			  		}
-   				}		
-		   		} 
-		   	//deletes all the history
-			if (strcmp(command->args[0], "clear")==0){
-				fhistory=freopen(NULL,"w",fhistory);
-			}
-			fclose(fhistory);
-			return SUCCESS;
-        	}
-        	
-        }
-	
-	int r;
-	if (strcmp(command->name, "")==0) return SUCCESS;
-
-	if (strcmp(command->name, "exit")==0)
-		return EXIT;
-
-	if (strcmp(command->name, "cd")==0)
+}
+void json_open(struct json_out *json, const char *key, char bracket)
+{
+	assert(json->depth<JSON_DEPTH);
+	json_key(json, key);
+	out_append(json->out, &bracket, 1);
+	json->first[json->depth++]=true;
+}
+void json_close(struct json_out *json, char bracket)
+{
+	out_append(json->out, &bracket, 1);
+	json->depth--;
+}
+/**
+ * Returns the length of the valid UTF-8 sequence at s, 0 if it is not one
+ */
+size_t utf8_sequence(const unsigned char *s, size_t len)
+{
+	size_t n;
+	if (s[0]>=0xC2 && s[0]<=0xDF) n=2;
+	else if (s[0]>=0xE0 && s[0]<=0xEF) n=3;
+	else if (s[0]>=0xF0 && s[0]<=0xF4) n=4;
+	else return 0;
+	if (n>len)
+		return 0;
+	for (size_t i=1;i<n;++i)
+		if ((s[i]&0xC0)!=0x80)
+			return 0;
+	//overlong forms, surrogates and code points past U+10FFFF
+	if ((s[0]==0xE0 && s[1]<0xA0) || (s[0]==0xED && s[1]>=0xA0) || (s[0]==0xF0 && s[1]<0x90) || (s[0]==0xF4 && s[1]>=0x90))
+		return 0;
+	return n;
+}
+/**
+ * Writes a string, binary safe: bytes that are not valid UTF-8 are written as \u00XX
+ */
+void json_string(struct json_out *json, const char *key, const char *s, size_t len)
+{
+	static const char hex[]="0123456789abcdef";
+	json_key(json, key);
+	out_append(json->out, "\"", 1);
+	size_t run=0; // start of the bytes copied as they are
+	for (size_t i=0;i<len;)
 	{
-		if (command->arg_count > 0)
+		unsigned char c=s[i];
+		if (c>=0x20 && c!='"' && c!='\\' && c<0x80)
 		{
-			r=chdir(command->args[0]);
-			if (r==-1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+			i++;
+			continue;
 		}
+		size_t n=c>=0x80 ? utf8_sequence((const unsigned char *)s+i, len-i) : 0;
+		if (n>0)
+		{
+			i+=n;
+			continue;
+		}
+		out_append(json->out, s+run, i-run);
+		char escape[6]={'\\', c, 0};
+		size_t escape_len=2;
+		if (c=='\n') escape[1]='n';
+		else if (c=='\t') escape[1]='t';
+		else if (c=='\r') escape[1]='r';
+		else if (c!='"' && c!='\\')
+		{
+			memcpy(escape, "\\u00", 4);
+			out_append(json->out, escape, 4);
+			escape[0]=hex[c>>4];
+			escape[1]=hex[c&15];
+		}
+		out_append(json->out, escape, escape_len);
+		run=++i;
 	}
-	
-	
-	
-	
-	//shortdir command implementation (Part II)
-	if (strcmp(command->name, "shortdir")==0)
-   	{
-        	if (command->arg_count > 0)
-        	{
-			char* cwd;
-			int PATH_MAX = 1024;
-			char buff[PATH_MAX];
-			char keys[1024][1024]; //array to store names
-			char values[1024][1024]; //array to store directories
-			int shortdir_count = 0; //stores the number of associations
-			
-			struct association{
-				char keys[1024][1024];
-				char values[1024][1024];
-				int shortdir_count;
-			}assoc;
-			
-			//returns the index of a name in the keys array
-			int get_index(char *key){
-				int i=0;
-				for(i = 0; i < shortdir_count; i++){
-					if (strcmp(keys[i], key)==0){
-						return i;
-						}
-				} return -1;
-			}
-			
-			//returns the index of a directory in the values array
-			int get_value_index(char *value){
-				int i=0;
-				for(i = 0; i < shortdir_count; i++){
-					if (strcmp(values[i], value)==0){
-						return i;
-						}
-				} return -1;
-			
-			}
-			
-			//file created to store the associations
-			char path_shortdir[256];
-			strcpy(path_shortdir, getenv("HOME"));
-			strcat(path_shortdir, "/shortdir");
-			FILE *fshortdir = fopen(path_shortdir, "r");
-			if(fshortdir != NULL){
-	    			fread(&assoc, sizeof(assoc), 1, fshortdir);
-	    			fclose(fshortdir);
-	    		}
-	    		//copies the variables of assoc struct
-	    		memcpy(keys, assoc.keys, sizeof(keys));
-	    		memcpy(values, assoc.values, sizeof(values));
-	    		shortdir_count = assoc.shortdir_count;
-	    
-	    	        //gets current directory	
-	    		cwd = getcwd(buff, PATH_MAX);
-	    		
-			//sets a new name to the current directory
-			if (strcmp(command->args[0], "set")==0){
-				//if a name is already used, prints a warning
-				if(get_index(command->args[1])!=-1){
-					printf("%s alias already used\n", command->args[1]);
-				}
-				//if the same directory already has a name, replaces it
-				else if (get_value_index(cwd)!=-1){
-					strcpy(keys[get_value_index(cwd)],
-					command->args[1]);
-					printf("%s is set as an alias for %s\n",
-				keys[get_index(command->args[1])],
-				values[get_index(command->args[1])]);
-				//if the name and directory were not used before, adds them to keys and values
-				}else{strcpy(keys[shortdir_count],command->args[1]);
-					strcpy(values[shortdir_count],cwd);
-					printf("%s is set as an alias for %s\n",
-				keys[shortdir_count],values[shortdir_count]);
-					shortdir_count++;
-				}
-				
-			}
-			//changes to the directory of the name
-			if (strcmp(command->args[0], "jump")==0){
-				chdir(values[get_index(command->args[1])]);
-			}
-			//deletes the name-directory association of the given name
-			if (strcmp(command->args[0], "del")==0){
-				int i=get_index(command->args[1]);
-				for(i; i < shortdir_count-1; i++){
-					strcpy(keys[i],keys[i+1]);
-					strcpy(values[i], values[i+1]);
-				}
-				shortdir_count--;
-			}
-			//lists all name-directory associations
-			if (strcmp(command->args[0], "list")==0){
-				for(int i=0; i < shortdir_count; i++){
-					printf("name: %s directory: %s\n", keys[i], values[i]);
-				}
-			}
-			// lists all name-directory associations
-			if (strcmp(command->args[0], "clear")==0){
-				char keys[1024][1024] = { 0 };
-				char values[1024][1024] = { 0 };
-				shortdir_count=0;
-			}
-			
-			//copies keys, values and shortdir_count to assoc struct
-	    		memcpy(assoc.keys, keys, sizeof(assoc.keys));
-	    		memcpy(assoc.values, values, sizeof(assoc.values));
-	    		assoc.shortdir_count = shortdir_count;
-	    		//writes assoc struct to the file to store associations
-			FILE *fshortdir_write = fopen(path_shortdir, "wb");
-	    		fwrite(&assoc, sizeof(assoc), 1, fshortdir_write);
-	    		fclose(fshortdir_write);
-	    		return SUCCESS;
-
-       	}
-        	}
-        	
-        
-        
-        //goodMorning implementation (Part IV)
-	if (strcmp(command->name, "goodMorning")==0)
-    {
-        if (command->arg_count == 2)
-        {
-            struct stat i;
-            if(stat(command->args[1],  &i)==0){
-            	//getting and splitting the given time 
-                char delim[] = ".";
-                char *time=strtok(command->args[0], delim);            
-                char *h;
-                h=time;
-                time = strtok(NULL,".");
-                char *m;
-                m=time;
-                
-                //creating shell script
-                FILE *music;
-                music = fopen("goodMorning.sh", "w");
-                char currentDir[1024];
-                getcwd(currentDir, sizeof(currentDir));
-                fprintf(music, "DISPLAY=:0 rhythmbox-client --play %s", command->args[1]);
-                fclose(music);
-
-		//creating crontab file and executing crontab command with execvp 
-		FILE *cron;
-		cron =fopen("crontab","w");
-		fprintf(cron, "%s %s * * * %s/goodMorning.sh\n",m,h, currentDir);
-		fclose(cron);
-		char* path=strcat(currentDir,"/crontab");
-		char* args[] = {"crontab",path,NULL};
-		execvp("crontab", args);
-		//execv("/usr/bin/crontab",path);
-		
-		return SUCCESS;
-
-            }else{
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            }
-
-        }
-    }
-    
-    //kdiff implementation (Part V)
-    if (strcmp(command->name, "kdiff")==0)
-    {
-        if (command->arg_count == 3)
-        {
-        	if(strcmp(command->args[0], "-a")==0){ //Line by line comparison
-        		struct stat i;
-            		if(stat(command->args[1],  &i)==0){ //Check whether first file is exist or not
-            			if(stat(command->args[2], &i)==0){ //Check whether second file is exist or not
-            			
-            				// getting the total line number of the first file
-            				FILE *file1;
-                			file1 = fopen(command->args[1], "r");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					int ch = getc(file1);
-    					int count1=0;
-  					while (ch != EOF) 
-  					{
-  					if(feof(file1)==0){
-    						count1++;
-    					}
-    					ch = getc(file1);
-  					}
-  					
-  					// getting the total line number of the second file
-                			FILE *file2;
-                			file2 = fopen(command->args[2], "r");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[2]);
-    					}
-    					int ch2 = getc(file2);
-    					int count2=0;
-  					while (ch2 != EOF) 
-  					{
-  					if(feof(file2)==0){
-    					count2++;
-    					}
-    					ch2 = getc(file2);
-  					}
-  					fclose(file1);
-  					fclose(file2);
-  					
-  					//opens the first file for comparison
-  					file1 = fopen(command->args[1], "r");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					
-    					//opens the second file for comparison
-    					file2 = fopen(command->args[2], "r");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[2]);
-    					}
-    					
-    					char str1[1000];
-    					char str2[1000];
-    					int dif = 0; //holds total different line number
-    					int max = (count1 > count2 ) ? count1 : count2;
-    					for(int i = 0; i< max;i++){
-    						fgets(str1, 1000, file1); //getting ith line of the first file
-    						fgets(str2, 1000, file2); //getting ith line of the second file
-    						
-    						if(feof(file1) && feof(file2)){
-    							continue;
-    						}
-    						
-    						int str1Len = strlen(str1);
-    						int str2Len = strlen(str2);
-    						int found = 0;
-    						
-    						//Comparison starts
-    						if(str1 != "" && str2 !=""){
-    							if(str1Len>=str2Len){
-    								found=0;
-    								for (int j = 0; j<str1Len; j++){
-    									if(str1[j] == str2[j]){ //compares char by char of the lines.
- 										found++;
- 									}
-    								}
-
-    								if(found!=str1Len){
-    									if(feof(file1)){
-    										printf("%s:Line %d:%s",command->args[1],i+1,"\n"); //If the first file's line is empty then print newline.
-    									}else{
-    										printf("%s:Line %d:%s",command->args[1],i+1,str1); //If the first file's line is not empty then print that line.
-    									}
-
-    									printf("%s:Line %d:%s",command->args[2],i+1,str2);
-    									dif++;
-    								}
-    							}else{
-    								found=0;
-    								for (int j = 0; j<str2Len; j++){ //compares char by char of the lines.
-    									if(str1[j] == str2[j]){
- 										found++;
- 									}
-    								}
-
-    								if(found!=str2Len){
-    									printf("%s:Line %d:%s",command->args[1],i+1,str1);
-    									if(feof(file2)){
-    										printf("%s:Line %d:%s",command->args[2],i+1,"\n"); //If the second file's line is empty then print newline.
-    									}else{
-    										printf("%s:Line %d:%s",command->args[2],i+1,str2); //If the second file's line is not empty then print that line.
-    									}
-    									
-    									dif++;
-    								}
-    							}
-    						}
-    					}
-    					
-    					if(dif!=0){
-    						printf("%d different lines are found\n",dif);
-    					}else{
-    						printf("Files are identical\n");
-    					}
-    					
-                			
-            			fclose(file1);
-            			fclose(file2);
-            			return SUCCESS;
-            			
-            			}else{
-            				printf("This file is not found: %s\n",command->args[2]);
-            			}
-        		}else{
-        			printf("This file is not found: %s\n",command->args[1]);
-        		}
-        		
-        	}else if(strcmp(command->args[0], "-b")==0){ //binary comparison of two files
-        		struct stat i;
-        		if(stat(command->args[1],  &i)==0){ //Check whether first file is exist or not
-            			if(stat(command->args[2], &i)==0){ //Check whether second file is exist or not
-            			
-            				// getting the total line number of the first file
-            				FILE *file1;
-                			file1 = fopen(command->args[1], "rb");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					int ch = getc(file1);
-    					int count1=0;
-  					while (ch != EOF) 
-  					{
-  					if(feof(file1)==0){
-    						count1++;
-    					}
-    					ch = getc(file1);
-  					}
-    					
-    					// getting the total line number of the second file
-    					FILE *file2;
-                			file2 = fopen(command->args[2], "r");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[2]);
-    					}
-    					int ch2 = getc(file2);
-    					int count2=0;
-  					while (ch2 != EOF) 
-  					{
-  					if(feof(file2)==0){
-    					count2++;
-    					}
-    					ch2 = getc(file2);
-  					}
-  					
-  					fclose(file1);
-  					fclose(file2);
-  					
-  					//opens the first file for comparison
-  					file1 = fopen(command->args[1], "rb");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					
-    					//opens the second file for comparison
-    					file2 = fopen(command->args[2], "rb");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[2]);
-    					}
-  					
-  					int dif = 0;
-    					int max = (count1 > count2 ) ? count1 : count2;
-    					int c1 = 0; // for first file's binary
-    					int c2 = 0; // for second file's binary
-    					for(int i = 0; i< max;i++){ //travel through the files to compare the binaries
-    						c1 = fgetc(file1);
-    						c2 = fgetc(file2);
-    						
-    						if(feof(file1) && feof(file2)){
-    							continue;
-    						}
-    						
-    						if(c1!=c2){ //If the binaries' are not equal, increase difference by 1
-    							dif = dif+1;
-    						}
-    					}
-    					
-    					if(dif!=0){
-    						printf("The two files are different in %d bytes\n",dif);
-    					}else{
-    						printf("Files are identical\n");
-    					}
-    					
-    					
-    					return SUCCESS;
-    				}else{
-            				printf("This file is not found: %s\n",command->args[2]);
-            			}
-        		}else{
-        			printf("This file is not found: %s\n",command->args[1]);
-        		}
-        		}
-   
-            }else if(command->arg_count == 2){ //line by line comparison when -a is not entered as an input
-            	struct stat i;
-            		if(stat(command->args[0],  &i)==0){ //Check whether first file is exist or not
-            			if(stat(command->args[1], &i)==0){ //Check whether second file is exist or not
-            			
-            				// getting the total line number of the first file
-            				FILE *file1;
-                			file1 = fopen(command->args[0], "r");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[0]);
-    					}
-    					int ch = getc(file1);
-    					int count1=0;
-  					while (ch != EOF) 
-  					{
-  					if(feof(file1)==0){
-  					
-    						count1++;
-    					}
-    					ch = getc(file1);
-  					}
-  					
-  					// getting the total line number of the second file
-                			FILE *file2;
-                			file2 = fopen(command->args[1], "r");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					int ch2 = getc(file2);
-    					int count2=0;
-  					while (ch2 != EOF) 
-  					{
-  					if(feof(file2)==0){
-    					count2++;
-    					}
-    					ch2 = getc(file2);
-  					}
-  					
-  					fclose(file1);
-  					fclose(file2);
-  					
-  					//opens the first file for comparison
-  					file1 = fopen(command->args[0], "r");
-                			if (file1 == NULL){
-        					printf("Could not open file %s",command->args[0]);
-    					}
-    					
-    					//opens the second file for comparison
-    					file2 = fopen(command->args[1], "r");
-                			if (file2 == NULL){
-        					printf("Could not open file %s",command->args[1]);
-    					}
-    					
-    					
-    					char str1[1000];
-    					char str2[1000];
-    					int dif = 0; //holds total different line number
-    					int max = (count1 > count2 ) ? count1 : count2;
-    					for(int i = 0; i< max;i++){
-    						fgets(str1, 1000, file1); //getting ith line of the first file
-    						fgets(str2, 1000, file2); //getting ith line of the second file
-    						if(feof(file1) && feof(file2)){
-    							continue;
-    						}
-    						int str1Len = strlen(str1);
-    						int str2Len = strlen(str2);
-    						int found = 0;
-    						
-    						//Comparison starts
-    						if(str1 != "" && str2 !=""){ 
-    							if(str1Len>=str2Len){
-    								found=0;
-    								for (int j = 0; j<str1Len; j++){
-    									if(str1[j] == str2[j]){ //compares char by char of the lines.
- 										found++;
- 									}
-    								}
-
-    								if(found!=str1Len){
-    									if(feof(file1)){
-    										printf("%s:Line %d:%s",command->args[0],i+1,"\n"); //If the first file's line is empty then print newline.
-    									}else{
-    										printf("%s:Line %d:%s",command->args[0],i+1,str1); //If the first file's line is not empty then print that line.
-    									}
-
-    									printf("%s:Line %d:%s",command->args[1],i+1,str2);
-    									dif++;
-    								}
-    							}else{
-    								found=0;
-    								for (int j = 0; j<str2Len; j++){
-    									if(str1[j] == str2[j]){
- 										found++;
- 									}
-    								}
-
-    								if(found!=str2Len){
-    									printf("%s:Line %d:%s",command->args[0],i+1,str1);
-    									if(feof(file2)){
-    										printf("%s:Line %d:%s",command->args[1],i+1,"\n"); //If the second file's line is empty then print newline.
-    									}else{
-    										printf("%s:Line %d:%s",command->args[1],i+1,str2); //If the second file's line is not empty then print that line.
-    									}
-    									
-    									dif++;
-    								}
-    							}
-    						}
-    					}
-    					
-    					if(dif!=0){
-    						printf("%d different lines are found\n",dif);
-    					}else{
-    						printf("Files are identical\n");
-    					}
-    					
-                			
-            			fclose(file1);
-            			fclose(file2);
-            			return SUCCESS;
-            			}else{
-            				printf("This file is not found: %s\n",command->args[1]);
-            			}
-        		}else{
-        			printf("This file is not found: %s\n",command->args[0]);
-        		}
-            	
-            
-            }else{
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            }
-
-        }
-    
-    //highlight implementation (Part III)
-    if (strcmp(command->name, "highlight")==0){
-		
-		if (command->arg_count == 3)
-        	{
-        	
-            	 struct stat i;
-           	 if(stat(command->args[2],  &i)==0){ //checks whether the file is exist or not
-           	 
-           	 	//opens the file
-           	 	FILE *file;
-			char str[1000];
-			file = fopen(command->args[2], "r");
-    			if (file == NULL){
-        			printf("Could not open file %s",command->args[2]);
-    			}
-    			
-    			//reads the file
- 			while (fgets(str, 1000, file) != NULL){
- 				
- 				int lineLength = strlen(str);
- 				int wordLength = strlen(command->args[0]);
- 				int occurence[1000] = {[0 ... 999] = -1}; //holds the location of the word in the file's line
- 				int count = 0;
-				int found = 1;
-				
- 				for (int i = 0 ; i < lineLength - wordLength; i++){ //travels through the line
- 					found = 0;
- 					for (int j = 0; j<wordLength; j++){ //compares the line subpart with the word.
- 						if(tolower(str[i+j]) == tolower(command->args[0][j])){
- 							found++;
- 						}
- 					}
- 					
- 					if(i==0){ //checks whether the word is the first word in the line.
- 						if(i+wordLength<=lineLength){ 
-
- 							if((str[i+wordLength] == ' ') || str[i+wordLength] == '\n'){ //checks whether the character after the word is space or newline.
-
- 								if(found==wordLength){ //If the found is equal to word's length, we found our word in the line.
- 									occurence[count] = i;
- 									count++;
- 								}
- 							
- 							}
- 							
- 							
- 						}
- 					}else if(str[i-1]==' '){ //checks whether the character before the word is space or not.
- 						if(i+wordLength<=lineLength){
-
- 							if((str[i+wordLength] == ' ') || str[i+wordLength] == '\n'){ //checks whether the character after the word is space or newline.
-
- 								if(found==wordLength){ //If the found is equal to word's length, we found our word in the line.
- 									occurence[count] = i;
- 									count++;
- 								}
- 							
- 							}
- 						}
- 					}else{
- 						
- 					}
- 					
- 				}
- 				
- 				if(occurence[0] != -1){ //checks whether you found the word in the line or not.
- 					int contains = 0;
- 					for (int k = 0; k < lineLength ; k++){
- 						contains = 0;
- 						for(int m = 0; m<lineLength; m++){
- 							if(occurence[m] == k) {
- 								contains = 1;
- 							}
- 						}
- 						if(contains == 1){
- 							if(strcmp(command->args[1], "r")==0){
- 								printf("\033[0;31m");	//to write in red
- 							}else if (strcmp(command->args[1], "g")==0){
- 								printf("\033[32m"); //to write in green
- 							
- 							}else if (strcmp(command->args[1], "b")==0){
- 								printf("\033[0;34m"); //to write in blue
- 							}
- 							for(int z = k; z<k+wordLength; z++) { //prints the word
- 								printf("%c",str[z]);
- 							}
- 							
- 							k = k + wordLength-1; //updating k in order to pass the word.
- 						}else{
- 							printf("\033[0m"); //reset the color
- 							printf("%c", str[k]); 
- 						}
- 						
- 						
- 					}
- 					printf("\033[0m"); //reset the color
- 					
- 				}
- 			}
- 			
-        		fclose(file);
-        		return SUCCESS;
-           	 }
-           	}
-	}
-
-	pid_t pid=fork();
-	if (pid==0) // child
-	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-	    // extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
-
-		// increase args size by 2
-		command->args=(char **)realloc(
-			command->args, sizeof(char *)*(command->arg_count+=2));
-
-		// shift everything forward by 1
-		for (int i=command->arg_count-2;i>0;--i)
-			command->args[i]=command->args[i-1];
-
-		// set args[0] as a copy of name
-		command->args[0]=strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count-1]=NULL;
-
-		//To get path of the command and prints it into the pathToCommand file (Part I)
-		char msgOut[1024]="";
-		strcat(msgOut, "which ");
-		strcat(msgOut, command->args[0]);
-		strcat(msgOut, "> pathToCommand");
-		system(msgOut);
-		FILE *file;
-		char str[1000];
-		file = fopen("pathToCommand", "r");
-    		if (file == NULL){
-        		printf("Could not open file %s","pathToCommand");
-    		}
-    		
- 		while (fgets(str, 1000, file) != NULL) //getting the path from the file.
-        	fclose(file);
-        	
-        	
-  		static char str1[99];
-    		int count = 0, j, k;
-  
-    		
-   		while (str[count] == ' ') { //finding the first apperance of the space
-    		    count++;
-    		    printf("%d\n",count);
-   		}
-  
-   		
-    		for (j = count, k = 0; str[j] != '\0'; j++, k++) { //To get only the written part of the line and copying it to another variable.
-        		str1[k] = str[j];
-    		}
-  
-    
-		str1[strcspn(str1, "\n")] = 0; //To put null into the position of new line.
-		remove ("pathToCommand"); //removing the file.
-  		execv(str1, command->args); //executing the command.
-  		
-		//execvp(command->name, command->args); // exec+args+path
-		
-		exit(0);
-		/// TODO: do your own exec with path resolving using execv()
-		
-		
-		
-	}
-	else
+	out_append(json->out, s+run, len-run);
+	out_append(json->out, "\"", 1);
+}
+void json_number(struct json_out *json, const char *key, long long value)
+{
+	char digits[24];
+	int n=sizeof(digits);
+	unsigned long long magnitude=value<0 ? -(unsigned long long)value : (unsigned long long)value;
+	do
+		digits[--n]='0'+magnitude%10;
+	while ((magnitude/=10)>0);
+	if (value<0)
+		digits[--n]='-';
+	json_key(json, key);
+	out_append(json->out, digits+n, sizeof(digits)-n);
+}
+//writer framing whole records on stdout
+struct json_writer {
+	enum json_mode mode;
+	struct out_buf buf;
+	long records; // written so far
+	struct json_out out; // the record being built
+};
+void json_flush(struct json_writer *writer)
+{
+	fwrite(writer->buf.data, 1, writer->buf.len, stdout);
+	writer->buf.len=0;
+}
+void json_begin(struct json_writer *writer, enum json_mode mode)
+{
+	memset(writer, 0, sizeof(struct json_writer));
+	writer->mode=mode;
+}
+void json_separator(struct json_writer *writer)
+{
+	if (writer->mode==JSON_ARRAY)
+		out_puts(&writer->buf, writer->records==0 ? "[\n" : ",\n");
+}
+/**
+ * Starts a record, its members are written through the returned builder
+ */
+struct json_out *json_record(struct json_writer *writer)
+{
+	json_separator(writer);
+	writer->out=(struct json_out){&writer->buf, 0, {false}};
+	json_open(&writer->out, NULL, '{');
+	return &writer->out;
+}
+void json_record_end(struct json_writer *writer)
+{
+	json_close(&writer->out, '}');
+	if (writer->mode==JSON_LINES)
+		out_append(&writer->buf, "\n", 1);
+	writer->records++;
+	if (writer->buf.len>=JSON_BUFFER)
+		json_flush(writer);
+}
+/**
+ * Writes records built elsewhere, each one ending with a newline
+ */
+void json_records(struct json_writer *writer, const char *data, size_t len)
+{
+	while (len>0)
 	{
-		if (!command->background)
-			wait(0); // wait for child process to finish
-		return SUCCESS;
+		const char *nl=memchr(data, '\n', len);
+		size_t n=nl ? (size_t)(nl-data) : len;
+		json_separator(writer);
+		out_append(&writer->buf, data, n);
+		if (writer->mode==JSON_LINES)
+			out_append(&writer->buf, "\n", 1);
+		writer->records++;
+		n+=nl!=NULL;
+		data+=n;
+		len-=n;
 	}
-
-	// TODO: your implementation here
-	
-	
-	
-	
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+	if (writer->buf.len>=JSON_BUFFER)
+		json_flush(writer);
+}
+void json_end(struct json_writer *writer)
+{
+	if (writer->mode==JSON_ARRAY)
+		out_puts(&writer->buf, writer->records>0 ? "\n]\n" : "[]\n");
+	json_flush(writer);
+	fflush(stdout);
+	free(writer->buf.data);
+}
+/**
+ * Takes --json or --ndjson out of a builtin's arguments
+ * @return the output mode asked for, JSON_OFF if none
+ */
+enum json_mode json_flag(struct command_t *command)
+{
+	enum json_mode mode=JSON_OFF;
+	int kept=0;
+	for (int i=0;i<command->arg_count;++i)
+	{
+		if (strcmp(command->args[i], "--json")==0 || strcmp(command->args[i], "--ndjson")==0)
+		{
+			mode=command->args[i][2]=='j' ? JSON_ARRAY : JSON_LINES;
+			free(command->args[i]);
+			continue;
+		}
+		command->args[kept]=command->args[i];
+		if (command->quotes)
+			command->quotes[kept]=command->quotes[i];
+		kept++;
+	}
+	command->arg_count=kept;
+	return mode;
+}
+
+//buffered reader shared by kdiff, highlight and hist: reads large page-aligned blocks with a sequential
+//readahead hint and hands out blocks or whole lines, so every builtin splits lines the same way and
+//no line is truncated. A line is returned without its newline and null terminated in the buffer.
+#define READER_BLOCK (1024*1024)
+#define READER_ALIGN 4096
+struct reader {
+	int fd;
+	bool owned; // opened by reader_open, closed by reader_close
+	char *buf;
+	size_t capacity; // one more byte is allocated for the terminator of an unterminated last line
+	size_t start, end; // unread data is buf[start, end)
+	size_t max_line; // longer lines are returned in pieces, 0 for no limit
+	bool eof;
+	bool newline; // the last line returned ended with a newline
+	char *piece; // holds a piece of a line longer than max_line
+};
+/**
+ * Sets up a reader on an open descriptor, which reader_close leaves open
+ */
+void reader_init(struct reader *reader, int fd)
+{
+	memset(reader, 0, sizeof(struct reader));
+	reader->fd=fd;
+	reader->capacity=READER_BLOCK;
+	if (posix_memalign((void **)&reader->buf, READER_ALIGN, reader->capacity+1)!=0)
+	{
+		reader->buf=NULL;
+		reader->capacity=0;
+		reader->eof=true;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); // fails harmlessly on pipes and terminals
+}
+/**
+ * Opens a file for reading
+ * @return false if it cannot be opened
+ */
+bool reader_open(struct reader *reader, const char *path)
+{
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+		return false;
+	reader_init(reader, fd);
+	reader->owned=true;
+	return true;
+}
+void reader_close(struct reader *reader)
+{
+	if (reader->owned)
+		close(reader->fd);
+	free(reader->buf);
+	free(reader->piece);
+	reader->buf=NULL;
+	reader->piece=NULL;
+}
+/**
+ * Moves the unread data to the front and reads more after it, growing the buffer when it is full
+ * @return bytes read, 0 at the end of input
+ */
+ssize_t reader_fill(struct reader *reader)
+{
+	if (reader->eof)
+		return 0;
+	if (reader->start>0)
+	{
+		memmove(reader->buf, reader->buf+reader->start, reader->end-reader->start);
+		reader->end-=reader->start;
+		reader->start=0;
+	}
+	if (reader->end==reader->capacity)
+	{
+		char *buf;
+		if (posix_memalign((void **)&buf, READER_ALIGN, reader->capacity*2+1)!=0)
+		{
+			reader->eof=true;
+			return 0;
+		}
+		memcpy(buf, reader->buf, reader->end);
+		free(reader->buf);
+		reader->buf=buf;
+		reader->capacity*=2;
+	}
+	ssize_t n;
+	do
+		n=read(reader->fd, reader->buf+reader->end, reader->capacity-reader->end);
+	while (n==-1 && errno==EINTR);
+	if (n<=0)
+	{
+		reader->eof=true;
+		return 0;
+	}
+	reader->end+=n;
+	return n;
+}
+/**
+ * Returns the buffered input, reading the next block when none is left, without consuming it
+ * @param  data set to the first unread byte, valid until the next call
+ * @return      bytes available, 0 at the end of input
+ */
+size_t reader_peek(struct reader *reader, const char **data)
+{
+	if (reader->start==reader->end)
+	{
+		reader->start=reader->end=0;
+		reader_fill(reader);
+	}
+	*data=reader->buf+reader->start;
+	return reader->end-reader->start;
+}
+/**
+ * Consumes bytes returned by reader_peek
+ */
+void reader_skip(struct reader *reader, size_t len)
+{
+	reader->start+=len;
+}
+/**
+ * Returns the next line without its newline, null terminated and valid until the next call
+ * @return false at the end of input
+ */
+bool reader_line(struct reader *reader, char **line, size_t *len)
+{
+	size_t scanned=0; // bytes already searched for a newline
+	while (1)
+	{
+		char *p=reader->buf+reader->start;
+		size_t available=reader->end-reader->start;
+		char *nl=available>scanned ? memchr(p+scanned, '\n', available-scanned) : NULL;
+		if (nl && (!reader->max_line || (size_t)(nl-p)<=reader->max_line))
+		{
+			*nl=0;
+			*line=p;
+			*len=nl-p;
+			reader->start+=*len+1;
+			reader->newline=true;
+			return true;
+		}
+		if (reader->max_line && available>=reader->max_line)
+		{
+			//a piece of an over-long line is copied out, so the byte after it stays intact
+			*len=reader->max_line;
+			reader->piece=realloc(reader->piece, *len+1);
+			memcpy(reader->piece, p, *len);
+			reader->piece[*len]=0;
+			*line=reader->piece;
+			reader->start+=*len;
+			reader->newline=false;
+			return true;
+		}
+		if (reader->eof)
+		{
+			if (available==0)
+				return false;
+			p[available]=0; // the spare byte past the capacity makes room for it
+			*line=p;
+			*len=available;
+			reader->start=reader->end;
+			reader->newline=false;
+			return true;
+		}
+		scanned=available;
+		reader_fill(reader);
+	}
+}
+
+//history rotation (the live file is history.txt, rotated segments are history.txt.1 (newest) .. history.txt.N (oldest))
+#define HISTORY_MAX_BYTES (512*1024) // rotate the live file once it grows past this size
+#define HISTORY_MAX_AGE_DAYS 30 // or once its oldest entry is older than this
+#define HISTORY_MAX_SEGMENTS 8 // rotated segments kept, the oldest one is dropped
+/**
+ * Builds the path of a history segment, segment 0 is the live history.txt
+ * @param buf     output buffer
+ * @param size    size of buf
+ * @param segment segment number
+ * @return        false if the path did not fit
+ */
+bool history_path(char *buf, size_t size, int segment)
+{
+	int len;
+	if (segment==0)
+		len=snprintf(buf, size, "%s/history.txt", getenv("HOME"));
+	else
+		len=snprintf(buf, size, "%s/history.txt.%d", getenv("HOME"), segment);
+	return len>=0 && (size_t)len<size;
+}
+/**
+ * Converts a dd/mm/YYYY history date into a sortable YYYYMMDD number
+ * @param  date date string
+ * @return      sortable key, -1 if the date cannot be parsed
+ */
+int history_date_key(const char *date)
+{
+	int d, m, y;
+	if (sscanf(date, "%d/%d/%d", &d, &m, &y)!=3)
+		return -1;
+	return y*10000+m*100+d;
+}
+/**
+ * Returns the command part of a history line, skipping user, date, day and time
+ * @param  line history line
+ * @return      pointer into line
+ */
+const char *history_line_command(const char *line)
+{
+	for (int field=0;field<4 && line;++field)
+	{
+		line=strchr(line, ' ');
+		if (line) line++;
+	}
+	return line ? line : "";
+}
+/**
+ * Compares two history lines by user and command, ignoring the time stamp
+ * @return true if both record the same command of the same user
+ */
+bool history_same_entry(const char *a, const char *b)
+{
+	size_t ua=strcspn(a, " "), ub=strcspn(b, " ");
+	if (ua!=ub || strncmp(a, b, ua)!=0)
+		return false;
+	return strcmp(history_line_command(a), history_line_command(b))==0;
+}
+/**
+ * Reads the last line of a file into buf
+ * @return true if a line was found
+ */
+bool history_last_line(const char *path, char *buf, size_t size)
+{
+	FILE *f=fopen(path, "r");
+	if (f==NULL)
+		return false;
+	char tail[4096];
+	fseek(f, 0, SEEK_END);
+	long end=ftell(f);
+	long start=end>(long)sizeof(tail)-1 ? end-(long)sizeof(tail)+1 : 0;
+	fseek(f, start, SEEK_SET);
+	size_t n=fread(tail, 1, end-start, f);
+	fclose(f);
+	while (n>0 && tail[n-1]=='\n') n--;
+	tail[n]=0;
+	if (n==0)
+		return false;
+	char *last=strrchr(tail, '\n');
+	snprintf(buf, size, "%s", last ? last+1 : tail);
+	return true;
+}
+/**
+ * Rebuilds the side index of a rotated segment: its date range and the users it contains,
+ * so user and date queries can skip segments that cannot match
+ * @param segment segment number (>0)
+ */
+void history_build_index(int segment)
+{
+	char path[512], index_path[520], tmp_path[528];
+	history_path(path, sizeof(path), segment);
+	snprintf(index_path, sizeof(index_path), "%s.idx", path);
+	struct reader reader;
+	if (!reader_open(&reader, path))
+	{
+		remove(index_path);
+		return;
+	}
+	int min_date=-1, max_date=-1;
+	char **users=NULL;
+	int user_count=0;
+	char *line;
+	size_t len;
+	while (reader_line(&reader, &line, &len))
+	{
+		char user[256], date[64];
+		if (sscanf(line, "%255s %63s", user, date)!=2)
+			continue;
+		int key=history_date_key(date);
+		if (key!=-1 && (min_date==-1 || key<min_date)) min_date=key;
+		if (key>max_date) max_date=key;
+		int i;
+		for (i=0;i<user_count;++i)
+			if (strcmp(users[i], user)==0)
+				break;
+		if (i==user_count)
+		{
+			users=realloc(users, sizeof(char *)*(user_count+1));
+			users[user_count++]=strdup(user);
+		}
+	}
+	reader_close(&reader);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+	FILE *idx=fopen(tmp_path, "w");
+	if (idx!=NULL)
+	{
+		fprintf(idx, "%d %d\n", min_date, max_date);
+		for (int i=0;i<user_count;++i)
+			fprintf(idx, "%s\n", users[i]);
+		fclose(idx);
+		rename(tmp_path, index_path);
+	}
+	for (int i=0;i<user_count;++i)
+		free(users[i]);
+	free(users);
+}
+/**
+ * Checks a segment's side index to see whether a user or date query can match it
+ * @param  segment segment number
+ * @param  mode    "user" or "date"
+ * @param  arg     queried user or date
+ * @return         false only if the segment surely has no match
+ */
+bool history_segment_may_match(int segment, const char *mode, const char *arg)
+{
+	if (segment==0)
+		return true;
+	char path[512], index_path[520];
+	history_path(path, sizeof(path), segment);
+	snprintf(index_path, sizeof(index_path), "%s.idx", path);
+	FILE *idx=fopen(index_path, "r");
+	if (idx==NULL)
+		return true;
+	int min_date, max_date;
+	bool may_match=true;
+	if (fscanf(idx, "%d %d\n", &min_date, &max_date)==2)
+	{
+		if (strcmp(mode, "date")==0)
+		{
+			int key=history_date_key(arg);
+			may_match=key==-1 || min_date==-1 || (key>=min_date && key<=max_date);
+		}
+		else if (strcmp(mode, "user")==0)
+		{
+			char user[256];
+			may_match=false;
+			while (fscanf(idx, "%255s", user)==1)
+				if (strcmp(user, arg)==0)
+				{
+					may_match=true;
+					break;
+				}
+		}
+	}
+	fclose(idx);
+	return may_match;
+}
+/**
+ * Shifts every segment up by one and turns the live file into segment 1,
+ * dropping the oldest segment
+ */
+void history_rotate()
+{
+	char from[512], to[512], from_idx[520], to_idx[520];
+	//the oldest segment has the longest name, truncated names would rename over each other
+	if (!history_path(to, sizeof(to), HISTORY_MAX_SEGMENTS))
+		return;
+	snprintf(to_idx, sizeof(to_idx), "%s.idx", to);
+	remove(to);
+	remove(to_idx);
+	for (int i=HISTORY_MAX_SEGMENTS-1;i>=0;--i)
+	{
+		history_path(from, sizeof(from), i);
+		history_path(to, sizeof(to), i+1);
+		snprintf(from_idx, sizeof(from_idx), "%s.idx", from);
+		snprintf(to_idx, sizeof(to_idx), "%s.idx", to);
+		rename(from, to);
+		if (i>0)
+			rename(from_idx, to_idx);
+	}
+	history_build_index(1);
+}
+/**
+ * Builds the path of one of history_compact's temporary group files
+ * @return false if the path did not fit
+ */
+bool history_compact_path(char *buf, size_t size, int group)
+{
+	char live[512];
+	if (!history_path(live, sizeof(live), 0))
+		return false;
+	int len=snprintf(buf, size, "%s.compact%d", live, group);
+	return len>=0 && (size_t)len<size;
+}
+/**
+ * Removes the temporary group files of an abandoned compaction
+ * @param groups number of groups written so far
+ */
+void history_compact_discard(int groups)
+{
+	char tmp_path[544];
+	for (int group=0;group<groups;++group)
+		if (history_compact_path(tmp_path, sizeof(tmp_path), group))
+			remove(tmp_path);
+}
+/**
+ * Compacts the rotated segments: drops consecutive duplicates (with histdedup on) and
+ * merges adjacent segments that together still fit in HISTORY_MAX_BYTES, then
+ * renumbers them and rebuilds their indexes. Nothing is renamed unless every group
+ * was written in full.
+ */
+void history_compact()
+{
+	char path[512], tmp_path[544];
+	//the oldest segment and the last group have the longest names
+	if (!history_path(path, sizeof(path), HISTORY_MAX_SEGMENTS)
+		|| !history_compact_path(tmp_path, sizeof(tmp_path), HISTORY_MAX_SEGMENTS))
+		return;
+	home_path(path, sizeof(path), ".history.lock");
+	int lock=lock_file(path, LOCK_EX);
+	FILE *out=NULL;
+	long out_size=0;
+	int groups=0;
+	bool ok=true;
+	char last[4096]="";
+	//walks the segments from the oldest to the newest, writing merged groups to temporary files
+	for (int segment=HISTORY_MAX_SEGMENTS;ok && segment>=1;--segment)
+	{
+		history_path(path, sizeof(path), segment);
+		struct stat st;
+		if (stat(path, &st)!=0)
+			continue;
+		if (out==NULL || out_size+st.st_size>HISTORY_MAX_BYTES)
+		{
+			if (out && fclose(out)!=0)
+				ok=false;
+			history_compact_path(tmp_path, sizeof(tmp_path), groups++);
+			out=ok ? fopen(tmp_path, "w") : NULL;
+			out_size=0;
+			if (out==NULL)
+			{
+				ok=false;
+				break;
+			}
+		}
+		//a segment that cannot be read would be dropped by the renumbering, so give up instead
+		struct reader in;
+		if (!reader_open(&in, path))
+		{
+			ok=false;
+			break;
+		}
+		char *line;
+		size_t n;
+		while (reader_line(&in, &line, &n))
+		{
+			if (shopt_enabled("histdedup") && history_same_entry(last, line))
+				continue;
+			fprintf(out, "%s\n", line);
+			out_size+=n+1;
+			snprintf(last, sizeof(last), "%s", line);
+		}
+		reader_close(&in);
+		if (ferror(out))
+			ok=false;
+	}
+	if (out && fclose(out)!=0)
+		ok=false;
+	if (!ok || groups==0)
+	{
+		history_compact_discard(groups);
+		unlock_file(lock);
+		return;
+	}
+	//the newest group becomes segment 1
+	for (int segment=1;segment<=HISTORY_MAX_SEGMENTS;++segment)
+	{
+		char index_path[520];
+		history_path(path, sizeof(path), segment);
+		snprintf(index_path, sizeof(index_path), "%s.idx", path);
+		if (segment<=groups)
+		{
+			history_compact_path(tmp_path, sizeof(tmp_path), groups-segment);
+			rename(tmp_path, path);
+			history_build_index(segment);
+		}
+		else
+		{
+			remove(path);
+			remove(index_path);
+		}
+	}
+	unlock_file(lock);
+}
+/**
+ * Runs history_compact in a detached grandchild so the prompt is not delayed
+ */
+void history_compact_background()
+{
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		if (fork()==0)
+		{
+			history_compact();
+			_exit(0);
+		}
+		_exit(0);
+	}
+	else if (pid>0)
+		waitpid(pid, NULL, 0);
+}
+/**
+ * Checks whether the live history file is past its size or age limit
+ * @param  path history file path
+ * @param  now  current time
+ * @return      true if it should be rotated
+ */
+bool history_needs_rotation(const char *path, time_t now)
+{
+	struct stat st;
+	if (stat(path, &st)!=0)
+		return false;
+	if (st.st_size>HISTORY_MAX_BYTES)
+		return true;
+	FILE *f=fopen(path, "r");
+	char user[256], date[64];
+	bool rotate=false;
+	if (f!=NULL && fscanf(f, "%255s %63s", user, date)==2)
+	{
+		struct tm oldest={0};
+		if (sscanf(date, "%d/%d/%d", &oldest.tm_mday, &oldest.tm_mon, &oldest.tm_year)==3)
+		{
+			oldest.tm_mon-=1;
+			oldest.tm_year-=1900;
+			oldest.tm_isdst=-1;
+			rotate=difftime(now, mktime(&oldest))>HISTORY_MAX_AGE_DAYS*24.0*3600;
+		}
+	}
+	if (f) fclose(f);
+	return rotate;
+}
+/**
+ * Appends a command to the live history file, rotating it when it grows too big or too old
+ * @param command command to record
+ */
+void history_record(struct command_t *command)
+{
+	char path_history[512];
+	history_path(path_history, sizeof(path_history), 0);
+
+	//gets the local time
+	time_t local_time;
+	struct tm * time_struct;
+	time(&local_time);
+	time_struct = localtime (&local_time);
+	char time_array[256] = {0};
+	strftime(time_array, 256, "%d/%m/%Y %a %X", time_struct); //stores the date, day info
+
+	//stores user, date and command info into a string
+	size_t len=strlen(getenv("USER"))+strlen(time_array)+strlen(command->name)+4;
+	for (int i = 0; i <command->arg_count; i++)
+		len+=strlen(command->args[i])+1;
+	char *history_line=malloc(len+1); // room for the record's newline
+	strcpy(history_line, getenv("USER"));
+	strcat(history_line, " ");
+	strcat(history_line, time_array);
+	strcat(history_line, " ");
+	strcat(history_line, command->name);
+	strcat(history_line, " ");
+	for (int i = 0; i <command->arg_count; i++){
+		strcat(history_line, command->args[i]);
+		strcat(history_line, " ");
+	}
+
+	//skips consecutive duplicates
+	char last[4096];
+	if (shopt_enabled("histdedup") && history_last_line(path_history, last, sizeof(last))
+		&& history_same_entry(last, history_line))
+	{
+		free(history_line);
+		return;
+	}
+
+	//the whole record goes out in a single O_APPEND write so concurrent sessions never interleave records
+	int fhistory = open(path_history, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+	if (fhistory == -1)
+	{
+		printf("Error: Could not open the file\n");
+		exit(1);
+	}
+	history_line[len-1]='\n';
+	history_line[len]=0;
+	write(fhistory, history_line, len);
+	close(fhistory);
+	free(history_line);
+
+	//rotates by size or by the age of the oldest entry
+	if (history_needs_rotation(path_history, local_time))
+	{
+		//another session may be rotating or compacting, it is retried on a later command
+		char lock_path[512];
+		home_path(lock_path, sizeof(lock_path), ".history.lock");
+		int lock=lock_file(lock_path, LOCK_EX|LOCK_NB);
+		if (lock==-1)
+			return;
+		bool rotate=history_needs_rotation(path_history, local_time); // re-check under the lock
+		if (rotate)
+			history_rotate();
+		unlock_file(lock);
+		if (rotate)
+			history_compact_background();
+	}
+}
+/**
+ * Writes a history line as a record: user, epoch time, date and command
+ */
+void history_json(struct json_writer *json, const char *line)
+{
+	struct json_out *out=json_record(json);
+	char user[256];
+	struct tm tm={0};
+	if (sscanf(line, "%255s %d/%d/%d %*s %d:%d:%d", user, &tm.tm_mday, &tm.tm_mon, &tm.tm_year,
+		&tm.tm_hour, &tm.tm_min, &tm.tm_sec)==7)
+	{
+		json_string(out, "user", user, strlen(user));
+		tm.tm_mon-=1;
+		tm.tm_year-=1900;
+		tm.tm_isdst=-1; // the time was recorded in local time
+		json_number(out, "time", mktime(&tm));
+		const char *date=strchr(line, ' ')+1;
+		json_string(out, "date", date, strcspn(date, " "));
+	}
+	const char *command=history_line_command(line);
+	size_t len=strlen(command);
+	while (len>0 && command[len-1]==' ') // entries are recorded with a trailing blank
+		len--;
+	json_string(out, "command", command, len);
+	json_record_end(json);
+}
+/**
+ * Prints the history entries (all segments, oldest first) matching a hist query
+ * @param mode "all", "user" or "date"
+ * @param arg  queried user or date, NULL for all
+ * @param json writer for --json and --ndjson, NULL for text
+ */
+void history_query(const char *mode, const char *arg, struct json_writer *json)
+{
+	char path[512];
+	for (int segment=HISTORY_MAX_SEGMENTS;segment>=0;--segment)
+	{
+		if (arg && !history_segment_may_match(segment, mode, arg))
+			continue;
+		history_path(path, sizeof(path), segment);
+		struct reader reader;
+		if (!reader_open(&reader, path))
+			continue;
+		char *line;
+		size_t n;
+		while (reader_line(&reader, &line, &n))
+		{
+			if (n==0) continue;
+			bool match=true;
+			//the user is the first field, the date the second one
+			if (strcmp(mode, "user")==0)
+				match=strncmp(line, arg, strcspn(line, " "))==0 && strlen(arg)==strcspn(line, " ");
+			else if (strcmp(mode, "date")==0)
+			{
+				const char *date=strchr(line, ' ');
+				match=date && strncmp(date+1, arg, strcspn(date+1, " "))==0
+					&& strlen(arg)==strcspn(date+1, " ");
+			}
+			if (match && json)
+				history_json(json, line);
+			else if (match)
+				printf("%s\n", line);
+		}
+		reader_close(&reader);
+	}
+}
+//reverse reader: maps the history segments newest first and walks each one backwards with memrchr,
+//so the newest N entries cost O(N) however long the history is
+struct history_reverse {
+	int segment; // segment mapped now, -1 before the first one
+	char *data;
+	size_t size;
+	const char *p; // the part before p has not been returned yet
+};
+void history_reverse_open(struct history_reverse *reverse)
+{
+	memset(reverse, 0, sizeof(struct history_reverse));
+	reverse->segment=-1;
+}
+void history_reverse_close(struct history_reverse *reverse)
+{
+	if (reverse->data)
+		munmap(reverse->data, reverse->size);
+	reverse->data=NULL;
+}
+/**
+ * Returns the next older entry, a view that stays valid until the next call
+ * @return false when every segment has been read
+ */
+bool history_reverse_line(struct history_reverse *reverse, const char **line, size_t *len)
+{
+	while (1)
+	{
+		if (reverse->data && reverse->p>reverse->data)
+		{
+			const char *end=reverse->p;
+			if (end[-1]=='\n')
+				end--;
+			const char *start=memrchr(reverse->data, '\n', end-reverse->data);
+			start=start ? start+1 : reverse->data;
+			reverse->p=start;
+			if (end==start)
+				continue;
+			*line=start;
+			*len=end-start;
+			return true;
+		}
+		history_reverse_close(reverse);
+		if (++reverse->segment>HISTORY_MAX_SEGMENTS)
+			return false;
+		char path[512];
+		history_path(path, sizeof(path), reverse->segment);
+		int fd=open(path, O_RDONLY|O_CLOEXEC);
+		struct stat st;
+		if (fd==-1)
+			continue;
+		if (fstat(fd, &st)==0 && st.st_size>0)
+		{
+			reverse->data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (reverse->data==MAP_FAILED)
+				reverse->data=NULL;
+			else
+			{
+				reverse->size=st.st_size;
+				reverse->p=reverse->data+reverse->size;
+			}
+		}
+		close(fd);
+	}
+}
+/**
+ * Copies the newest entries
+ * @param  count  how many are wanted
+ * @param  lines  set to them, newest first (free each and the array)
+ * @return        how many were found
+ */
+int history_last(int count, char ***lines)
+{
+	*lines=malloc(sizeof(char *)*(count>0 ? count : 1));
+	struct history_reverse reverse;
+	history_reverse_open(&reverse);
+	const char *line;
+	size_t len;
+	int n=0;
+	while (n<count && history_reverse_line(&reverse, &line, &len))
+		(*lines)[n++]=strndup(line, len);
+	history_reverse_close(&reverse);
+	return n;
+}
+/**
+ * Removes every history segment and truncates the live file
+ */
+void history_clear()
+{
+	char path[512], index_path[520], tmp_path[528];
+	home_path(path, sizeof(path), ".history.lock");
+	int lock=lock_file(path, LOCK_EX);
+	for (int segment=HISTORY_MAX_SEGMENTS;segment>=1;--segment)
+	{
+		history_path(path, sizeof(path), segment);
+		snprintf(index_path, sizeof(index_path), "%s.idx", path);
+		remove(path);
+		remove(index_path);
+	}
+	//swaps in an empty file instead of truncating underneath other writers
+	history_path(path, sizeof(path), 0);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	int fd=open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd!=-1)
+	{
+		close(fd);
+		rename(tmp_path, path);
+	}
+	unlock_file(lock);
+}
+
+//entries written by any session, picked up incrementally by following history.txt
+#define HISTORY_RECENT_MAX 1000
+#define HISTORY_PRELOAD_DEFAULT 100 // entries loaded at startup for the up arrow
+char *history_recent[HISTORY_RECENT_MAX]; // ring buffer of the newest entries
+int history_recent_count=0, history_recent_start=0;
+long history_recent_total=0; // entries ever pushed, to tell which ones are new
+int history_watch_fd=-1; // inotify descriptor watching the home directory
+off_t history_offset=0; // bytes of history.txt already picked up
+ino_t history_inode=0; // inode of history.txt when history_offset was taken
+void history_recent_push(const char *line, size_t len)
+{
+	int slot=(history_recent_start+history_recent_count)%HISTORY_RECENT_MAX;
+	if (history_recent_count==HISTORY_RECENT_MAX)
+	{
+		free(history_recent[slot]);
+		history_recent_start=(history_recent_start+1)%HISTORY_RECENT_MAX;
+	}
+	else
+		history_recent_count++;
+	history_recent[slot]=strndup(line, len);
+	history_recent_total++;
+}
+/**
+ * Returns the command of a recent entry, for the up arrow
+ * @param  age 1 for the newest entry
+ * @param  len set to its length
+ * @return     NULL past the oldest entry
+ */
+const char *history_recall(int age, size_t *len)
+{
+	if (age<1 || age>history_recent_count)
+		return NULL;
+	const char *line=history_line_command(history_recent[(history_recent_start+history_recent_count-age)%HISTORY_RECENT_MAX]);
+	*len=strlen(line);
+	while (*len>0 && line[*len-1]==' ') // entries are recorded with a trailing blank
+		(*len)--;
+	return line;
+}
+/**
+ * Reads the complete records of a history file from offset on
+ * @return the offset after the last complete record
+ */
+off_t history_read_from(const char *path, ino_t inode, off_t offset)
+{
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+		return offset;
+	struct stat st;
+	if (fstat(fd, &st)==-1 || st.st_ino!=inode || st.st_size<=offset)
+	{
+		close(fd);
+		return offset;
+	}
+	size_t size=st.st_size-offset;
+	char *data=malloc(size);
+	ssize_t n=pread(fd, data, size, offset);
+	close(fd);
+	char *p=data, *end=data+(n>0 ? n : 0), *nl;
+	while ((nl=memchr(p, '\n', end-p))!=NULL) // a partial last record is left for the next poll
+	{
+		if (nl>p)
+			history_recent_push(p, nl-p);
+		p=nl+1;
+	}
+	offset+=p-data;
+	free(data);
+	return offset;
+}
+/**
+ * Starts following history.txt from its current end
+ */
+void history_follow_init()
+{
+	char path[512];
+	history_path(path, sizeof(path), 0);
+	struct stat st;
+	if (stat(path, &st)==0)
+	{
+		history_inode=st.st_ino;
+		history_offset=st.st_size;
+	}
+	history_watch_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (history_watch_fd!=-1)
+		inotify_add_watch(history_watch_fd, getenv("HOME"), IN_MODIFY|IN_CREATE|IN_MOVED_TO|IN_MOVED_FROM);
+}
+/**
+ * Picks up history entries appended by any session since the last poll.
+ * Costs a single non-blocking read when nothing changed.
+ */
+void history_poll()
+{
+	if (history_watch_fd!=-1)
+	{
+		char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		bool changed=false;
+		ssize_t n;
+		while ((n=read(history_watch_fd, events, sizeof(events)))>0)
+			for (char *p=events;p<events+n;p+=sizeof(struct inotify_event)+((struct inotify_event *)p)->len)
+			{
+				struct inotify_event *event=(struct inotify_event *)p;
+				if (event->len && strcmp(event->name, "history.txt")==0)
+					changed=true;
+			}
+		if (!changed)
+			return;
+	}
+	char path[512], rotated[512];
+	history_path(path, sizeof(path), 0);
+	struct stat st;
+	if (stat(path, &st)!=0)
+		return;
+	if (st.st_ino!=history_inode)
+	{
+		//the file was rotated or cleared, finish the old one if it became segment 1
+		history_path(rotated, sizeof(rotated), 1);
+		history_read_from(rotated, history_inode, history_offset);
+		history_inode=st.st_ino;
+		history_offset=0;
+	}
+	else if (st.st_size<history_offset)
+		history_offset=0;
+	history_offset=history_read_from(path, history_inode, history_offset);
+}
+/**
+ * Number of entries loaded at startup, set by SEASHELL_HISTORY_PRELOAD
+ */
+int history_preload_count()
+{
+	const char *value=getenv("SEASHELL_HISTORY_PRELOAD");
+	int count=value && *value ? atoi(value) : HISTORY_PRELOAD_DEFAULT;
+	return count<0 ? 0 : count>HISTORY_RECENT_MAX ? HISTORY_RECENT_MAX : count;
+}
+/**
+ * Fills the recent entries at startup, so the up arrow recalls commands of earlier sessions
+ */
+void history_preload(int count)
+{
+	char **lines;
+	int n=history_last(count, &lines);
+	for (int i=n-1;i>=0;--i)
+	{
+		history_recent_push(lines[i], strlen(lines[i]));
+		free(lines[i]);
+	}
+	free(lines);
+}
+/**
+ * Prints the newest entries, oldest first
+ */
+void history_print_last(int count, struct json_writer *json)
+{
+	char **lines;
+	int n=history_last(count, &lines);
+	for (int i=n-1;i>=0;--i)
+	{
+		if (json)
+			history_json(json, lines[i]);
+		else
+			printf("%s\n", lines[i]);
+		free(lines[i]);
+	}
+	free(lines);
+}
+/**
+ * Prints the newest entries, then every entry any session adds until a line is entered
+ */
+void history_tail(int count, bool follow, struct json_writer *json)
+{
+	history_print_last(count, json);
+	if (!follow)
+		return;
+	history_poll(); // picks up what was printed above, so it is not printed again
+	long seen=history_recent_total;
+	while (1)
+	{
+		if (json)
+			json_flush(json);
+		fflush(stdout);
+		struct pollfd fds[2]={{STDIN_FILENO, POLLIN, 0}, {history_watch_fd, POLLIN, 0}};
+		//without inotify the file is checked every second
+		if (poll(fds, history_watch_fd!=-1 ? 2 : 1, history_watch_fd!=-1 ? -1 : 1000)==-1 && errno!=EINTR)
+			break;
+		if (fds[0].revents)
+		{
+			char discard[4096];
+			read(STDIN_FILENO, discard, sizeof(discard));
+			break;
+		}
+		history_poll();
+		//entries that already left the ring are lost, the ring holds the newest HISTORY_RECENT_MAX
+		if (history_recent_total-seen>HISTORY_RECENT_MAX)
+			seen=history_recent_total-HISTORY_RECENT_MAX;
+		for (;seen<history_recent_total;++seen)
+		{
+			int age=history_recent_total-seen; // 1 for the newest
+			const char *line=history_recent[(history_recent_start+history_recent_count-age)%HISTORY_RECENT_MAX];
+			if (json)
+				history_json(json, line);
+			else
+				printf("%s\n", line);
+		}
+	}
+}
+//shortdir aliases, stored in ~/shortdir as "name<TAB>directory" lines
+struct shortdir_map {
+	char **keys; //names
+	char **values; //directories
+	int count;
+	int capacity;
+};
+#define SHORTDIR_LEGACY_SIZE (2*1024*1024+sizeof(int)) // fixed size file written by older versions
+/**
+ * Adds a name-directory association, growing the arrays as needed
+ */
+void shortdir_add(struct shortdir_map *map, const char *key, const char *value)
+{
+	if (map->count==map->capacity)
+	{
+		map->capacity=map->capacity ? map->capacity*2 : 16;
+		map->keys=realloc(map->keys, sizeof(char *)*map->capacity);
+		map->values=realloc(map->values, sizeof(char *)*map->capacity);
+	}
+	map->keys[map->count]=strdup(key);
+	map->values[map->count]=strdup(value);
+	map->count++;
+}
+/**
+ * Loads the associations from path, also reading the older fixed-size format
+ */
+void shortdir_load(struct shortdir_map *map, const char *path)
+{
+	FILE *f=fopen(path, "r");
+	if (f==NULL)
+		return;
+	struct stat st;
+	if (fstat(fileno(f), &st)==0 && st.st_size==SHORTDIR_LEGACY_SIZE)
+	{
+		char *legacy=malloc(st.st_size);
+		int count=0;
+		if (fread(legacy, st.st_size, 1, f)==1)
+			memcpy(&count, legacy+2*1024*1024, sizeof(int));
+		for (int i=0;i<count && i<1024;++i)
+			shortdir_add(map, legacy+i*1024, legacy+1024*1024+i*1024);
+		free(legacy);
+		fclose(f);
+		return;
+	}
+	char *line=NULL;
+	size_t cap=0;
+	ssize_t n;
+	while ((n=getline(&line, &cap, f))!=-1)
+	{
+		if (n>0 && line[n-1]=='\n') line[--n]=0;
+		char *tab=strchr(line, '\t');
+		if (tab==NULL)
+			continue;
+		*tab=0;
+		shortdir_add(map, line, tab+1);
+	}
+	free(line);
+	fclose(f);
+}
+/**
+ * Writes the associations to a temporary file and swaps it in
+ * @return 0 on success, -1 on error
+ */
+int shortdir_save(struct shortdir_map *map, const char *path)
+{
+	char path_tmp[600];
+	snprintf(path_tmp, sizeof(path_tmp), "%s.%d", path, getpid());
+	FILE *f=fopen(path_tmp, "w");
+	if (f==NULL)
+		return -1;
+	for (int i=0;i<map->count;++i)
+		fprintf(f, "%s\t%s\n", map->keys[i], map->values[i]);
+	if (fclose(f)!=0 || rename(path_tmp, path)!=0)
+	{
+		remove(path_tmp);
+		return -1;
+	}
+	return 0;
+}
+//returns the index of a name (in keys) or of a directory (in values), -1 if missing
+int shortdir_find(char **array, int count, const char *s)
+{
+	for (int i=0;i<count;++i)
+		if (strcmp(array[i], s)==0)
+			return i;
+	return -1;
+}
+void shortdir_remove(struct shortdir_map *map, int index)
+{
+	free(map->keys[index]);
+	free(map->values[index]);
+	memmove(map->keys+index, map->keys+index+1, sizeof(char *)*(map->count-index-1));
+	memmove(map->values+index, map->values+index+1, sizeof(char *)*(map->count-index-1));
+	map->count--;
+}
+void shortdir_free(struct shortdir_map *map)
+{
+	for (int i=0;i<map->count;++i)
+	{
+		free(map->keys[i]);
+		free(map->values[i]);
+	}
+	free(map->keys);
+	free(map->values);
+	memset(map, 0, sizeof(*map));
+}
+
+/**
+ * 64-bit FNV-1a hash, fnv1a_continue goes on from a previous hash (or another seed)
+ */
+uint64_t fnv1a_continue(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p=data;
+	for (size_t i=0;i<len;++i)
+	{
+		hash^=p[i];
+		hash*=1099511628211ULL;
+	}
+	return hash;
+}
+uint64_t fnv1a(const void *data, size_t len)
+{
+	return fnv1a_continue(14695981039346656037ULL, data, len);
+}
+
+//frecency database of visited directories (~/.seashell_dirs), every line is "rank<TAB>last access<TAB>directory".
+//visits are appended as rank 1 lines and summed up on load; the file is rewritten aggregated once it has
+//many more lines than directories. Fragment queries go through a trigram index of the lowercased paths.
+#define DIR_INDEX_MAX_RANK 10000.0 // total rank above which all ranks are aged
+struct dir_entry {
+	char *path;
+	double rank;
+	time_t last_access;
+};
+struct trigram_posting {
+	uint32_t trigram; // 0 marks an empty slot
+	int count;
+	int capacity;
+	int *dirs; // indices into dir_index.dirs, ascending
+};
+struct dir_index {
+	struct dir_entry *dirs;
+	int count, capacity;
+	int *path_slots; // open addressing table of dirs indices, -1 if empty
+	int path_slot_capacity;
+	struct trigram_posting *trigrams; // open addressing table keyed by trigram
+	int trigram_capacity, trigram_used;
+	off_t offset; // bytes of the database already applied
+	ino_t inode;
+	long lines; // lines applied, used to decide when to rewrite
+} dir_index;
+uint32_t trigram_at(const char *s)
+{
+	return ((uint32_t)(unsigned char)tolower(s[0])<<16) | ((uint32_t)(unsigned char)tolower(s[1])<<8)
+		| (unsigned char)tolower(s[2]);
+}
+struct trigram_posting *dir_index_trigram_slot(uint32_t trigram)
+{
+	uint32_t mask=dir_index.trigram_capacity-1;
+	uint32_t i=(trigram*2654435761u)&mask;
+	while (dir_index.trigrams[i].trigram!=0 && dir_index.trigrams[i].trigram!=trigram)
+		i=(i+1)&mask;
+	return &dir_index.trigrams[i];
+}
+void dir_index_add_trigram(uint32_t trigram, int dir)
+{
+	if ((dir_index.trigram_used+1)*2>dir_index.trigram_capacity)
+	{
+		struct trigram_posting *old=dir_index.trigrams;
+		int old_capacity=dir_index.trigram_capacity;
+		dir_index.trigram_capacity=old_capacity ? old_capacity*2 : 1024;
+		dir_index.trigrams=calloc(dir_index.trigram_capacity, sizeof(struct trigram_posting));
+		for (int i=0;i<old_capacity;++i)
+			if (old[i].trigram!=0)
+				*dir_index_trigram_slot(old[i].trigram)=old[i];
+		free(old);
+	}
+	struct trigram_posting *posting=dir_index_trigram_slot(trigram);
+	if (posting->trigram==0)
+	{
+		posting->trigram=trigram;
+		dir_index.trigram_used++;
+	}
+	if (posting->count>0 && posting->dirs[posting->count-1]==dir)
+		return; // the trigram repeats within the same path
+	if (posting->count==posting->capacity)
+	{
+		posting->capacity=posting->capacity ? posting->capacity*2 : 4;
+		posting->dirs=realloc(posting->dirs, sizeof(int)*posting->capacity);
+	}
+	posting->dirs[posting->count++]=dir;
+}
+int *dir_index_path_slot(const char *path)
+{
+	uint32_t mask=dir_index.path_slot_capacity-1;
+	uint32_t i=fnv1a(path, strlen(path))&mask;
+	while (dir_index.path_slots[i]!=-1 && strcmp(dir_index.dirs[dir_index.path_slots[i]].path, path)!=0)
+		i=(i+1)&mask;
+	return &dir_index.path_slots[i];
+}
+/**
+ * Returns the entry of a directory, adding it to the index if it is new
+ */
+struct dir_entry *dir_index_entry(const char *path)
+{
+	if ((dir_index.count+1)*2>dir_index.path_slot_capacity)
+	{
+		free(dir_index.path_slots);
+		dir_index.path_slot_capacity=dir_index.path_slot_capacity ? dir_index.path_slot_capacity*2 : 1024;
+		dir_index.path_slots=malloc(sizeof(int)*dir_index.path_slot_capacity);
+		memset(dir_index.path_slots, -1, sizeof(int)*dir_index.path_slot_capacity);
+		for (int i=0;i<dir_index.count;++i)
+			*dir_index_path_slot(dir_index.dirs[i].path)=i;
+	}
+	int *slot=dir_index_path_slot(path);
+	if (*slot!=-1)
+		return &dir_index.dirs[*slot];
+	if (dir_index.count==dir_index.capacity)
+	{
+		dir_index.capacity=dir_index.capacity ? dir_index.capacity*2 : 256;
+		dir_index.dirs=realloc(dir_index.dirs, sizeof(struct dir_entry)*dir_index.capacity);
+	}
+	int dir=dir_index.count++;
+	*slot=dir;
+	dir_index.dirs[dir].path=strdup(path);
+	dir_index.dirs[dir].rank=0;
+	dir_index.dirs[dir].last_access=0;
+	for (size_t i=0;i+3<=strlen(path);++i)
+		dir_index_add_trigram(trigram_at(path+i), dir);
+	return &dir_index.dirs[dir];
+}
+void dir_index_free()
+{
+	for (int i=0;i<dir_index.count;++i)
+		free(dir_index.dirs[i].path);
+	for (int i=0;i<dir_index.trigram_capacity;++i)
+		free(dir_index.trigrams[i].dirs);
+	free(dir_index.dirs);
+	free(dir_index.path_slots);
+	free(dir_index.trigrams);
+	memset(&dir_index, 0, sizeof(dir_index));
+}
+/**
+ * Brings the in-memory index up to date with the database, reading only the lines appended
+ * since the last refresh unless the file was replaced
+ */
+void dir_index_refresh()
+{
+	char path[512];
+	home_path(path, sizeof(path), ".seashell_dirs");
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+		return;
+	struct stat st;
+	fstat(fd, &st);
+	if (st.st_ino!=dir_index.inode || st.st_size<dir_index.offset)
+	{
+		dir_index_free();
+		dir_index.inode=st.st_ino;
+	}
+	if (st.st_size>dir_index.offset)
+	{
+		size_t size=st.st_size-dir_index.offset;
+		char *data=malloc(size+1);
+		ssize_t n=pread(fd, data, size, dir_index.offset);
+		char *p=data, *end=data+(n>0 ? n : 0), *nl;
+		while ((nl=memchr(p, '\n', end-p))!=NULL)
+		{
+			*nl=0;
+			double rank;
+			long last_access;
+			int consumed;
+			if (sscanf(p, "%lf\t%ld\t%n", &rank, &last_access, &consumed)==2 && p[consumed])
+			{
+				struct dir_entry *entry=dir_index_entry(p+consumed);
+				entry->rank+=rank;
+				if (last_access>entry->last_access)
+					entry->last_access=last_access;
+			}
+			dir_index.lines++;
+			p=nl+1;
+		}
+		dir_index.offset+=p-data;
+		free(data);
+	}
+	close(fd);
+}
+/**
+ * Scores a directory by its visit rank weighted by how recently it was visited
+ */
+double dir_frecency(struct dir_entry *entry, time_t now)
+{
+	double age=difftime(now, entry->last_access);
+	if (age<3600) return entry->rank*4;
+	if (age<86400) return entry->rank*2;
+	if (age<604800) return entry->rank/2;
+	return entry->rank/4;
+}
+/**
+ * Rewrites the database with one aggregated line per directory, aging the ranks
+ */
+void dir_index_rewrite()
+{
+	char path[512], path_lock[512], path_tmp[600];
+	home_path(path, sizeof(path), ".seashell_dirs");
+	home_path(path_lock, sizeof(path_lock), ".seashell_dirs.lock");
+	int lock=lock_file(path_lock, LOCK_EX|LOCK_NB);
+	if (lock==-1)
+		return; // another session is rewriting it
+	dir_index_refresh();
+	double total=0;
+	for (int i=0;i<dir_index.count;++i)
+		total+=dir_index.dirs[i].rank;
+	double aging=total>DIR_INDEX_MAX_RANK ? 0.9*DIR_INDEX_MAX_RANK/total : 1;
+	snprintf(path_tmp, sizeof(path_tmp), "%s.%d", path, getpid());
+	FILE *f=fopen(path_tmp, "w");
+	if (f!=NULL)
+	{
+		for (int i=0;i<dir_index.count;++i)
+		{
+			double rank=dir_index.dirs[i].rank*aging;
+			if (rank>=1)
+				fprintf(f, "%g\t%ld\t%s\n", rank, (long)dir_index.dirs[i].last_access, dir_index.dirs[i].path);
+		}
+		if (fclose(f)==0)
+			rename(path_tmp, path);
+		else
+			remove(path_tmp);
+	}
+	unlock_file(lock);
+	dir_index_free(); // reloaded from the new file on the next refresh
+}
+/**
+ * Records a visit to the current directory
+ */
+void dir_index_record()
+{
+	char cwd[4096], path[512], path_lock[512], line[4200];
+	if (getcwd(cwd, sizeof(cwd))==NULL)
+		return;
+	home_path(path, sizeof(path), ".seashell_dirs");
+	home_path(path_lock, sizeof(path_lock), ".seashell_dirs.lock");
+	int len=snprintf(line, sizeof(line), "1\t%ld\t%s\n", (long)time(NULL), cwd);
+	//appends share the lock, so a rewrite never renames over a visit it has not read
+	int lock=lock_file(path_lock, LOCK_SH);
+	int fd=open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+	if (fd!=-1)
+	{
+		write(fd, line, len);
+		close(fd);
+	}
+	unlock_file(lock);
+	if (fd==-1)
+		return;
+	//reads just what was appended since the last refresh, this visit and other sessions' ones
+	dir_index_refresh();
+	if (dir_index.lines>1000 && dir_index.lines>2L*dir_index.count)
+		dir_index_rewrite();
+}
+/**
+ * Case-insensitively checks that the fragments appear in the path in order
+ */
+bool dir_matches(const char *path, char **fragments, int count)
+{
+	for (int i=0;i<count;++i)
+	{
+		path=strcasestr(path, fragments[i]);
+		if (path==NULL)
+			return false;
+		path+=strlen(fragments[i]);
+	}
+	return true;
+}
+/**
+ * Finds the highest scored directory matching all fragments
+ * @return the directory, NULL if none matches
+ */
+const char *dir_index_query(char **fragments, int count)
+{
+	dir_index_refresh();
+	//candidates come from the shortest posting list among the fragments' trigrams
+	struct trigram_posting *best=NULL;
+	bool indexed=false;
+	for (int i=0;i<count;++i)
+		for (size_t j=0;j+3<=strlen(fragments[i]);++j)
+		{
+			indexed=true;
+			struct trigram_posting *posting=dir_index.trigram_capacity ? dir_index_trigram_slot(trigram_at(fragments[i]+j)) : NULL;
+			if (posting==NULL || posting->trigram==0)
+				return NULL; // no directory contains this trigram
+			if (best==NULL || posting->count<best->count)
+				best=posting;
+		}
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd))==NULL)
+		cwd[0]=0;
+	time_t now=time(NULL);
+	const char *result=NULL;
+	double result_score=0;
+	int candidates=indexed ? best->count : dir_index.count;
+	for (int i=0;i<candidates;++i)
+	{
+		struct dir_entry *entry=&dir_index.dirs[indexed ? best->dirs[i] : i];
+		if (strcmp(entry->path, cwd)==0 || !dir_matches(entry->path, fragments, count))
+			continue;
+		double score=dir_frecency(entry, now);
+		struct stat st;
+		if ((result==NULL || score>result_score) && stat(entry->path, &st)==0 && S_ISDIR(st.st_mode))
+		{
+			result=entry->path;
+			result_score=score;
+		}
+	}
+	return result;
+}
+//work-stealing thread pool: every worker owns a deque, pops its own tasks from the tail and
+//steals from the head of the others' when it runs out
+struct pool_task {
+	void (*run)(void *arg);
+	void *arg;
+};
+struct pool_deque {
+	struct pool_task *tasks;
+	int head, tail, capacity;
+	pthread_mutex_t lock;
+};
+struct thread_pool {
+	int worker_count;
+	pthread_t *threads;
+	struct pool_deque *deques;
+	pthread_mutex_t lock; // guards queued and pending
+	pthread_cond_t work; // signaled when a task is queued
+	pthread_cond_t done; // signaled when pending drops to 0
+	int queued; // tasks waiting in the deques
+	int pending; // tasks submitted and not finished yet
+	int next; // round robin deque for tasks submitted outside the pool
+};
+struct thread_pool *shell_pool=NULL;
+__thread int pool_worker_id=-1;
+bool pool_take(struct thread_pool *pool, int id, struct pool_task *task)
+{
+	for (int i=0;i<pool->worker_count;++i)
+	{
+		int victim=(id+i)%pool->worker_count;
+		struct pool_deque *deque=&pool->deques[victim];
+		bool found=false;
+		pthread_mutex_lock(&deque->lock);
+		if (deque->head!=deque->tail)
+		{
+			if (victim==id) // own deque, newest first
+				*task=deque->tasks[--deque->tail%deque->capacity];
+			else // steal the oldest
+				*task=deque->tasks[deque->head++%deque->capacity];
+			found=true;
+		}
+		pthread_mutex_unlock(&deque->lock);
+		if (found)
+		{
+			pthread_mutex_lock(&pool->lock);
+			pool->queued--;
+			pthread_mutex_unlock(&pool->lock);
+			return true;
+		}
+	}
+	return false;
+}
+void *pool_worker(void *arg)
+{
+	struct thread_pool *pool=shell_pool;
+	pool_worker_id=(int)(long)arg;
+	struct pool_task task;
+	while (1)
+	{
+		if (pool_take(pool, pool_worker_id, &task))
+		{
+			task.run(task.arg);
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending==0)
+				pthread_cond_broadcast(&pool->done);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued==0)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+//the workers do not exist in a forked child, it starts a new pool on first use
+void pool_atfork_child()
+{
+	shell_pool=NULL;
+	pool_worker_id=-1;
+}
+/**
+ * Returns the shell's thread pool, starting one worker per online CPU on first use
+ */
+struct thread_pool *pool_get()
+{
+	if (shell_pool!=NULL)
+		return shell_pool;
+	static bool registered=false;
+	if (!registered)
+	{
+		pthread_atfork(NULL, NULL, pool_atfork_child);
+		registered=true;
+	}
+	struct thread_pool *pool=calloc(1, sizeof(struct thread_pool));
+	pool->worker_count=sysconf(_SC_NPROCESSORS_ONLN);
+	if (pool->worker_count<1)
+		pool->worker_count=1;
+	pool->threads=malloc(sizeof(pthread_t)*pool->worker_count);
+	pool->deques=calloc(pool->worker_count, sizeof(struct pool_deque));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	shell_pool=pool;
+	for (int i=0;i<pool->worker_count;++i)
+	{
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+		pool->deques[i].capacity=64;
+		pool->deques[i].tasks=malloc(sizeof(struct pool_task)*64);
+		pthread_create(&pool->threads[i], NULL, pool_worker, (void *)(long)i);
+	}
+	return pool;
+}
+/**
+ * Queues a task, on the calling worker's own deque when called from a task
+ */
+void pool_submit(struct thread_pool *pool, void (*run)(void *), void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	int id=pool_worker_id!=-1 ? pool_worker_id : pool->next++%pool->worker_count;
+	pool->queued++;
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+	struct pool_deque *deque=&pool->deques[id];
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail-deque->head==deque->capacity)
+	{
+		struct pool_task *tasks=malloc(sizeof(struct pool_task)*deque->capacity*2);
+		for (int i=deque->head;i<deque->tail;++i)
+			tasks[i-deque->head]=deque->tasks[i%deque->capacity];
+		free(deque->tasks);
+		deque->tasks=tasks;
+		deque->tail-=deque->head;
+		deque->head=0;
+		deque->capacity*=2;
+	}
+	deque->tasks[deque->tail++%deque->capacity]=(struct pool_task){run, arg};
+	pthread_mutex_unlock(&deque->lock);
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+/**
+ * Waits until every submitted task has finished
+ */
+void pool_wait(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending>0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+//pattern matcher used by highlight: the pattern is parsed into a small syntax tree, compiled to a
+//Thompson NFA and then fully converted to a DFA over byte classes (bytes no pattern set tells apart
+//share a column), so matching is table lookups only and the compiled matcher can be shared by threads.
+//Supported syntax: literals, ., [...] and [^...] with ranges, \d \w \s \D \W \S and escaped
+//metacharacters, (...), |, *, +, ?, {m}, {m,}, {m,n}, ^ and $. A { that does not start a bound is a
+//literal {. ^ and $ are assertions that consume the virtual begin and end of line symbols, fed before
+//the first and after the last byte only, so they anchor just the alternative they appear in and one
+//that is not at an end of the line never matches.
+#define MATCHER_MAX_NFA_STATES 20000
+#define MATCHER_MAX_DFA_STATES 10000
+#define MATCHER_MAX_REPEAT 1000
+#define MATCHER_BOL -2 // nfa_state set consuming the begin of line
+#define MATCHER_EOL -3 // and the end of line
+enum regex_node_type { RE_SET, RE_CONCAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_REPEAT, RE_EMPTY, RE_BOL, RE_EOL };
+struct regex_node {
+	enum regex_node_type type;
+	int set; // RE_SET: index into matcher sets
+	int left, right; // children
+	int min, max; // RE_REPEAT bounds, max -1 for unbounded
+};
+struct byte_set {
+	uint64_t bits[4];
+};
+struct nfa_state {
+	int set; // consumes a byte of this set (or MATCHER_BOL / MATCHER_EOL) and goes to next, -1 for none
+	int next;
+	int eps[2]; // epsilon transitions
+	int eps_count;
+	bool match;
+};
+struct matcher {
+	bool ignore_case;
+	bool whole_word;
+	//parse
+	const char *pattern;
+	size_t pos;
+	const char *error;
+	struct regex_node *nodes;
+	int node_count, node_capacity;
+	struct byte_set *sets;
+	int set_count, set_capacity;
+	//nfa
+	struct nfa_state *nfa;
+	int nfa_count, nfa_capacity;
+	int nfa_start;
+	//dfa
+	unsigned char byte_class[256];
+	int class_count;
+	int *transitions; // [state*class_count+class], -1 is the dead state
+	bool *accepting;
+	bool *accepting_end; // accepting once the end of line is consumed
+	int dfa_count;
+	int bol_start; // DFA state of a candidate starting at the begin of the line
+	bool bol_only; // no match can start anywhere else
+	bool first_byte[256]; // bytes a match can start with
+	char prefix[64]; // literal every match starts with (case-sensitive patterns only)
+	size_t prefix_len;
+};
+static inline bool byte_set_has(const struct byte_set *set, unsigned char c)
+{
+	return (set->bits[c>>6]>>(c&63))&1;
+}
+static inline void byte_set_add(struct byte_set *set, unsigned char c)
+{
+	set->bits[c>>6]|=1ULL<<(c&63);
+}
+int matcher_node(struct matcher *m, enum regex_node_type type, int left, int right)
+{
+	if (m->node_count==m->node_capacity)
+	{
+		m->node_capacity=m->node_capacity ? m->node_capacity*2 : 32;
+		m->nodes=realloc(m->nodes, sizeof(struct regex_node)*m->node_capacity);
+	}
+	m->nodes[m->node_count]=(struct regex_node){type, -1, left, right, 0, 0};
+	return m->node_count++;
+}
+/**
+ * Adds the other case of every letter in the set when ignoring case
+ */
+void matcher_fold(struct matcher *m, struct byte_set *set)
+{
+	if (m->ignore_case)
+		for (int c='A';c<='Z';++c)
+			if (byte_set_has(set, c) || byte_set_has(set, tolower(c)))
+			{
+				byte_set_add(set, c);
+				byte_set_add(set, tolower(c));
+			}
+}
+/**
+ * Adds a set that is already folded
+ */
+int matcher_folded_set_node(struct matcher *m, struct byte_set *set)
+{
+	if (m->set_count==m->set_capacity)
+	{
+		m->set_capacity=m->set_capacity ? m->set_capacity*2 : 16;
+		m->sets=realloc(m->sets, sizeof(struct byte_set)*m->set_capacity);
+	}
+	m->sets[m->set_count]=*set;
+	int node=matcher_node(m, RE_SET, -1, -1);
+	m->nodes[node].set=m->set_count++;
+	return node;
+}
+int matcher_set_node(struct matcher *m, struct byte_set *set)
+{
+	matcher_fold(m, set);
+	return matcher_folded_set_node(m, set);
+}
+/**
+ * Adds the bytes of a \d \w \s style class escape, returns false if c is not one
+ */
+bool matcher_class_escape(char c, struct byte_set *set)
+{
+	struct byte_set class={{0}};
+	char lower=tolower(c);
+	if (lower!='d' && lower!='w' && lower!='s')
+		return false;
+	for (int b=0;b<256;++b)
+		if ((lower=='d' && isdigit(b)) || (lower=='w' && (isalnum(b) || b=='_')) || (lower=='s' && isspace(b)))
+			byte_set_add(&class, b);
+	for (int i=0;i<4;++i)
+		set->bits[i]|=isupper(c) ? ~class.bits[i] : class.bits[i];
+	return true;
+}
+/**
+ * Reads a {m}, {m,} or {m,n} bound, max is -1 when unbounded
+ * @return the length of the bound, 0 if p does not start one (it is then a literal {)
+ */
+int matcher_bound(const char *p, int *min, int *max)
+{
+	int consumed=0;
+	if (p[0]!='{' || !isdigit((unsigned char)p[1]))
+		return 0;
+	if (sscanf(p, "{%d,%d}%n", min, max, &consumed)==2 && consumed)
+		return consumed;
+	consumed=0;
+	if (sscanf(p, "{%d,}%n", min, &consumed)==1 && consumed)
+	{
+		*max=-1;
+		return consumed;
+	}
+	consumed=0;
+	if (sscanf(p, "{%d}%n", min, &consumed)==1 && consumed)
+	{
+		*max=*min;
+		return consumed;
+	}
+	return 0;
+}
+int matcher_parse_alt(struct matcher *m);
+int matcher_parse_atom(struct matcher *m)
+{
+	const char *p=m->pattern;
+	struct byte_set set={{0}};
+	char c=p[m->pos++];
+	if (c=='(')
+	{
+		int node=matcher_parse_alt(m);
+		if (p[m->pos]!=')')
+		{
+			m->error="missing )";
+			return -1;
+		}
+		m->pos++;
+		return node;
+	}
+	if (c=='.')
+	{
+		for (int b=0;b<256;++b)
+			if (b!='\n')
+				byte_set_add(&set, b);
+		return matcher_set_node(m, &set);
+	}
+	if (c=='[')
+	{
+		bool negate=p[m->pos]=='^';
+		if (negate) m->pos++;
+		bool first=true;
+		while (p[m->pos] && (p[m->pos]!=']' || first))
+		{
+			first=false;
+			unsigned char lo=p[m->pos++];
+			if (lo=='\\' && p[m->pos])
+			{
+				if (matcher_class_escape(p[m->pos], &set))
+				{
+					m->pos++;
+					continue;
+				}
+				lo=p[m->pos++];
+			}
+			unsigned char hi=lo;
+			if (p[m->pos]=='-' && p[m->pos+1] && p[m->pos+1]!=']')
+			{
+				hi=p[m->pos+1];
+				m->pos+=2;
+			}
+			for (int b=lo;b<=hi;++b)
+				byte_set_add(&set, b);
+		}
+		if (p[m->pos]!=']')
+		{
+			m->error="missing ]";
+			return -1;
+		}
+		m->pos++;
+		//folded before negating, or [^a] would get a back from the A in its complement
+		matcher_fold(m, &set);
+		if (negate)
+			for (int i=0;i<4;++i)
+				set.bits[i]=~set.bits[i];
+		return matcher_folded_set_node(m, &set);
+	}
+	if (c=='\\')
+	{
+		if (!p[m->pos])
+		{
+			m->error="trailing \\";
+			return -1;
+		}
+		c=p[m->pos++];
+		if (matcher_class_escape(c, &set))
+			return matcher_set_node(m, &set);
+		if (c=='t') c='\t';
+	}
+	else if (c=='^' || c=='$')
+		return matcher_node(m, c=='^' ? RE_BOL : RE_EOL, -1, -1);
+	else if (c=='*' || c=='+' || c=='?' || c==')' || (c=='{' && matcher_bound(p+m->pos-1, &(int){0}, &(int){0})))
+	{
+		m->error="misplaced operator";
+		return -1;
+	}
+	byte_set_add(&set, c);
+	return matcher_set_node(m, &set);
+}
+int matcher_parse_repeat(struct matcher *m)
+{
+	int node=matcher_parse_atom(m);
+	const char *p=m->pattern;
+	while (node!=-1)
+	{
+		char c=p[m->pos];
+		if (c=='*' || c=='+' || c=='?')
+		{
+			m->pos++;
+			node=matcher_node(m, c=='*' ? RE_STAR : c=='+' ? RE_PLUS : RE_QUEST, node, -1);
+		}
+		else if (c=='{')
+		{
+			int min, max, consumed=matcher_bound(p+m->pos, &min, &max);
+			if (consumed==0)
+				break; // a literal {, parsed as the next atom
+			if (min>MATCHER_MAX_REPEAT || max>MATCHER_MAX_REPEAT || (max!=-1 && max<min))
+			{
+				m->error="bad repetition count";
+				return -1;
+			}
+			m->pos+=consumed;
+			node=matcher_node(m, RE_REPEAT, node, -1);
+			m->nodes[node].min=min;
+			m->nodes[node].max=max;
+		}
+		else
+			break;
+	}
+	return node;
+}
+int matcher_parse_concat(struct matcher *m)
+{
+	int node=-1;
+	const char *p=m->pattern;
+	while (p[m->pos] && p[m->pos]!='|' && p[m->pos]!=')')
+	{
+		int next=matcher_parse_repeat(m);
+		if (next==-1)
+			return -1;
+		node=node==-1 ? next : matcher_node(m, RE_CONCAT, node, next);
+	}
+	return node==-1 ? matcher_node(m, RE_EMPTY, -1, -1) : node;
+}
+int matcher_parse_alt(struct matcher *m)
+{
+	int node=matcher_parse_concat(m);
+	while (node!=-1 && m->pattern[m->pos]=='|')
+	{
+		m->pos++;
+		int right=matcher_parse_concat(m);
+		if (right==-1)
+			return -1;
+		node=matcher_node(m, RE_ALT, node, right);
+	}
+	return node;
+}
+int matcher_nfa_state(struct matcher *m)
+{
+	if (m->nfa_count==m->nfa_capacity)
+	{
+		m->nfa_capacity=m->nfa_capacity ? m->nfa_capacity*2 : 64;
+		m->nfa=realloc(m->nfa, sizeof(struct nfa_state)*m->nfa_capacity);
+	}
+	m->nfa[m->nfa_count]=(struct nfa_state){-1, -1, {-1, -1}, 0, false};
+	return m->nfa_count++;
+}
+void matcher_eps(struct matcher *m, int from, int to)
+{
+	if (m->nfa[from].eps_count==2) // chain through a new state when both slots are used
+	{
+		int extra=matcher_nfa_state(m);
+		m->nfa[extra].eps[0]=m->nfa[from].eps[1];
+		m->nfa[extra].eps_count=1;
+		m->nfa[from].eps[1]=extra;
+		from=extra;
+	}
+	m->nfa[from].eps[m->nfa[from].eps_count++]=to;
+}
+/**
+ * Compiles a syntax tree node into an NFA fragment
+ * @return false if the NFA grows past MATCHER_MAX_NFA_STATES
+ */
+bool matcher_compile_node(struct matcher *m, int node, int *start, int *end)
+{
+	if (m->nfa_count>MATCHER_MAX_NFA_STATES)
+		return false;
+	struct regex_node n=m->nodes[node];
+	int s, e, s2, e2;
+	switch (n.type)
+	{
+	case RE_SET:
+		*start=matcher_nfa_state(m);
+		*end=matcher_nfa_state(m);
+		m->nfa[*start].set=n.set;
+		m->nfa[*start].next=*end;
+		return true;
+	case RE_EMPTY:
+		*start=*end=matcher_nfa_state(m);
+		return true;
+	case RE_BOL:
+	case RE_EOL:
+		*start=matcher_nfa_state(m);
+		*end=matcher_nfa_state(m);
+		m->nfa[*start].set=n.type==RE_BOL ? MATCHER_BOL : MATCHER_EOL;
+		m->nfa[*start].next=*end;
+		return true;
+	case RE_CONCAT:
+		if (!matcher_compile_node(m, n.left, start, &e) || !matcher_compile_node(m, n.right, &s2, end))
+			return false;
+		matcher_eps(m, e, s2);
+		return true;
+	case RE_ALT:
+		if (!matcher_compile_node(m, n.left, &s, &e) || !matcher_compile_node(m, n.right, &s2, &e2))
+			return false;
+		*start=matcher_nfa_state(m);
+		*end=matcher_nfa_state(m);
+		matcher_eps(m, *start, s);
+		matcher_eps(m, *start, s2);
+		matcher_eps(m, e, *end);
+		matcher_eps(m, e2, *end);
+		return true;
+	case RE_STAR:
+	case RE_PLUS:
+	case RE_QUEST:
+		if (!matcher_compile_node(m, n.left, &s, &e))
+			return false;
+		*start=matcher_nfa_state(m);
+		*end=matcher_nfa_state(m);
+		matcher_eps(m, *start, s);
+		if (n.type!=RE_PLUS)
+			matcher_eps(m, *start, *end);
+		if (n.type!=RE_QUEST)
+			matcher_eps(m, e, s);
+		matcher_eps(m, e, *end);
+		return true;
+	case RE_REPEAT:
+		//x{m,n} is m copies of x followed by n-m optional ones (or x* when unbounded)
+		*start=*end=matcher_nfa_state(m);
+		for (int i=0;i<n.min || (n.max==-1 && i==n.min) || (n.max!=-1 && i<n.max);++i)
+		{
+			if (!matcher_compile_node(m, n.left, &s, &e))
+				return false;
+			matcher_eps(m, *end, s);
+			int after=matcher_nfa_state(m);
+			matcher_eps(m, e, after);
+			if (i>=n.min)
+			{
+				matcher_eps(m, *end, after); // optional copy
+				if (n.max==-1)
+					matcher_eps(m, e, s);
+			}
+			*end=after;
+			if (n.max==-1 && i>=n.min)
+				break;
+		}
+		return true;
+	}
+	return false;
+}
+/**
+ * Adds the epsilon closure of state to a sorted DFA state set
+ */
+void matcher_closure(struct matcher *m, int state, int *set, int *count, int *mark, int generation, int *stack)
+{
+	int top=0;
+	stack[top++]=state;
+	while (top>0)
+	{
+		int s=stack[--top];
+		if (mark[s]==generation)
+			continue;
+		mark[s]=generation;
+		if (m->nfa[s].set!=-1 || m->nfa[s].match)
+		{
+			int i=(*count)++;
+			while (i>0 && set[i-1]>s) // keeps the set sorted so equal sets compare equal
+			{
+				set[i]=set[i-1];
+				i--;
+			}
+			set[i]=s;
+		}
+		for (int i=0;i<m->nfa[s].eps_count;++i)
+			stack[top++]=m->nfa[s].eps[i];
+	}
+}
+/**
+ * Adds to a DFA state set what it reaches by consuming MATCHER_BOL or MATCHER_EOL, any number of times
+ * @param pending scratch of nfa_count entries
+ */
+void matcher_assert_closure(struct matcher *m, int symbol, int *set, int *count, int *mark, int generation, int *stack, int *pending)
+{
+	for (;;)
+	{
+		int pending_count=0;
+		for (int i=0;i<*count;++i)
+			if (m->nfa[set[i]].set==symbol && mark[m->nfa[set[i]].next]!=generation)
+				pending[pending_count++]=m->nfa[set[i]].next;
+		if (pending_count==0)
+			return;
+		for (int i=0;i<pending_count;++i)
+			matcher_closure(m, pending[i], set, count, mark, generation, stack);
+	}
+}
+/**
+ * Builds the DFA by subset construction over the byte classes
+ * @return false if it would need more than MATCHER_MAX_DFA_STATES states
+ */
+bool matcher_build_dfa(struct matcher *m)
+{
+	//bytes that belong to exactly the same sets share a class
+	int representative[256];
+	m->class_count=0;
+	for (int b=0;b<256;++b)
+	{
+		int c;
+		for (c=0;c<m->class_count;++c)
+		{
+			int r=representative[c], i;
+			for (i=0;i<m->set_count;++i)
+				if (byte_set_has(&m->sets[i], b)!=byte_set_has(&m->sets[i], r))
+					break;
+			if (i==m->set_count)
+				break;
+		}
+		if (c==m->class_count)
+			representative[m->class_count++]=b;
+		m->byte_class[b]=c;
+	}
+	int *mark=calloc(m->nfa_count, sizeof(int));
+	int *stack=malloc(sizeof(int)*(m->nfa_count*2+1));
+	int generation=0;
+	//dfa states are sorted nfa state lists stored back to back in sets
+	int *sets=NULL, *offsets=NULL, *sizes=NULL;
+	size_t sets_len=0, sets_capacity=0;
+	int capacity=0;
+	int *work=malloc(sizeof(int)*m->nfa_count), *pending=malloc(sizeof(int)*m->nfa_count);
+	int work_count=0;
+	bool ok=true;
+	m->dfa_count=0;
+	for (int state=-1;ok && state<m->dfa_count;++state)
+	{
+		//state -1 adds the two start states: the plain one (0) and the one at the begin of the line
+		for (int c=0;c<(state==-1 ? 2 : m->class_count);++c)
+		{
+			if (state==-1)
+			{
+				work_count=0;
+				generation++;
+				matcher_closure(m, m->nfa_start, work, &work_count, mark, generation, stack);
+				if (c==1)
+					matcher_assert_closure(m, MATCHER_BOL, work, &work_count, mark, generation, stack, pending);
+			}
+			else
+			{
+				//moves every nfa state on the class representative
+				work_count=0;
+				generation++;
+				for (int i=0;i<sizes[state];++i)
+				{
+					struct nfa_state *s=&m->nfa[sets[offsets[state]+i]];
+					if (s->set>=0 && byte_set_has(&m->sets[s->set], representative[c]))
+						matcher_closure(m, s->next, work, &work_count, mark, generation, stack);
+				}
+				if (work_count==0)
+				{
+					m->transitions[state*m->class_count+c]=-1;
+					continue;
+				}
+			}
+			int found;
+			for (found=0;found<m->dfa_count;++found)
+				if (sizes[found]==work_count && memcmp(sets+offsets[found], work, sizeof(int)*work_count)==0)
+					break;
+			if (found==m->dfa_count)
+			{
+				if (m->dfa_count==MATCHER_MAX_DFA_STATES)
+				{
+					ok=false;
+					break;
+				}
+				if (m->dfa_count==capacity)
+				{
+					capacity=capacity ? capacity*2 : 16;
+					offsets=realloc(offsets, sizeof(int)*capacity);
+					sizes=realloc(sizes, sizeof(int)*capacity);
+					m->accepting=realloc(m->accepting, sizeof(bool)*capacity);
+					m->accepting_end=realloc(m->accepting_end, sizeof(bool)*capacity);
+					m->transitions=realloc(m->transitions, sizeof(int)*capacity*m->class_count);
+				}
+				if (sets_len+work_count>sets_capacity)
+				{
+					sets_capacity=(sets_len+work_count)*2;
+					sets=realloc(sets, sizeof(int)*sets_capacity);
+				}
+				memcpy(sets+sets_len, work, sizeof(int)*work_count);
+				offsets[found]=sets_len;
+				sizes[found]=work_count;
+				sets_len+=work_count;
+				m->accepting[found]=false;
+				for (int i=0;i<work_count;++i)
+					if (m->nfa[work[i]].match)
+						m->accepting[found]=true;
+				m->dfa_count++;
+			}
+			if (state!=-1)
+				m->transitions[state*m->class_count+c]=found;
+			else if (c==1)
+				m->bol_start=found;
+		}
+	}
+	//the states that accept once the end of line is consumed
+	for (int state=0;ok && state<m->dfa_count;++state)
+	{
+		work_count=sizes[state];
+		generation++;
+		memcpy(work, sets+offsets[state], sizeof(int)*work_count);
+		for (int i=0;i<work_count;++i)
+			mark[work[i]]=generation;
+		matcher_assert_closure(m, MATCHER_EOL, work, &work_count, mark, generation, stack, pending);
+		m->accepting_end[state]=false;
+		for (int i=0;i<work_count;++i)
+			if (m->nfa[work[i]].match)
+				m->accepting_end[state]=true;
+	}
+	//the bytes a match can start with, from either start state
+	memset(m->first_byte, 0, sizeof(m->first_byte));
+	m->bol_only=ok;
+	for (int c=0;ok && c<m->class_count;++c)
+		if (m->transitions[c]!=-1)
+			m->bol_only=false;
+	int starts[2]={0, m->bol_start};
+	for (int k=0;ok && k<2;++k)
+		for (int i=0;i<sizes[starts[k]];++i)
+		{
+			struct nfa_state *s=&m->nfa[sets[offsets[starts[k]]+i]];
+			for (int b=0;b<256;++b)
+				if (s->match || (s->set>=0 && byte_set_has(&m->sets[s->set], b)))
+					m->first_byte[b]=true;
+		}
+	free(mark);
+	free(stack);
+	free(work);
+	free(pending);
+	free(sets);
+	free(offsets);
+	free(sizes);
+	return ok;
+}
+/**
+ * Collects the literal prefix of the tree (single-byte sets at the start of a concatenation)
+ * @return false once the prefix stops being literal
+ */
+bool matcher_literal_prefix(struct matcher *m, int node)
+{
+	struct regex_node *n=&m->nodes[node];
+	if (n->type==RE_CONCAT)
+		return matcher_literal_prefix(m, n->left) && matcher_literal_prefix(m, n->right);
+	if (n->type!=RE_SET || m->prefix_len==sizeof(m->prefix))
+		return false;
+	int found=-1;
+	for (int b=0;b<256;++b)
+		if (byte_set_has(&m->sets[n->set], b))
+		{
+			if (found!=-1)
+				return false;
+			found=b;
+		}
+	m->prefix[m->prefix_len++]=found;
+	return true;
+}
+void matcher_free(struct matcher *m)
+{
+	free(m->nodes);
+	free(m->sets);
+	free(m->nfa);
+	free(m->transitions);
+	free(m->accepting);
+	free(m->accepting_end);
+	memset(m, 0, sizeof(*m));
+}
+/**
+ * Compiles a pattern
+ * @param  m           matcher to fill
+ * @param  pattern     the pattern
+ * @param  regex       false to match the pattern literally
+ * @param  ignore_case case-insensitive matching
+ * @param  whole_word  matches must not touch a letter, digit or _ on either side
+ * @return             NULL on success, an error message otherwise
+ */
+const char *matcher_compile(struct matcher *m, const char *pattern, bool regex, bool ignore_case, bool whole_word)
+{
+	memset(m, 0, sizeof(*m));
+	m->ignore_case=ignore_case;
+	m->whole_word=whole_word;
+	int root;
+	if (regex)
+	{
+		m->pattern=pattern;
+		root=matcher_parse_alt(m);
+		if (root!=-1 && pattern[m->pos])
+			m->error="unmatched )";
+		if (m->error)
+			return m->error;
+	}
+	else
+	{
+		root=matcher_node(m, RE_EMPTY, -1, -1);
+		for (const char *p=pattern;*p;++p)
+		{
+			struct byte_set set={{0}};
+			byte_set_add(&set, *p);
+			int node=matcher_set_node(m, &set);
+			root=p==pattern ? node : matcher_node(m, RE_CONCAT, root, node);
+		}
+	}
+	int end;
+	if (!matcher_compile_node(m, root, &m->nfa_start, &end))
+		return "pattern too large";
+	m->nfa[end].match=true;
+	if (!matcher_build_dfa(m))
+		return "pattern too complex";
+	if (!ignore_case)
+		matcher_literal_prefix(m, root);
+	return NULL;
+}
+static inline bool is_word_byte(unsigned char c)
+{
+	return isalnum(c) || c=='_';
+}
+//per-thread scratch of matcher_find, so one compiled matcher can be used by every pool worker
+struct matcher_thread {
+	int state; // anchored DFA state
+	size_t start; // where this candidate match started
+};
+struct matcher_scratch {
+	struct matcher_thread *threads, *next;
+	int *mark; // per DFA state, the step it was last reached in
+	int capacity, step;
+};
+static __thread struct matcher_scratch matcher_scratch;
+/**
+ * Finds the leftmost-longest non-empty match at or after from, in one forward pass.
+ * A candidate is started at every position until a match is found, and candidates are advanced
+ * together through the anchored DFA. Two candidates in the same DFA state have the same future,
+ * so only the one that started first is kept: at most one per DFA state is alive and every byte
+ * is read once.
+ * @return true with [*start, *end) set if found
+ */
+bool matcher_find(const struct matcher *m, const char *line, size_t len, size_t from, size_t *start, size_t *end)
+{
+	const unsigned char *s=(const unsigned char *)line;
+	struct matcher_scratch *scratch=&matcher_scratch;
+	if (m->bol_only && from>0)
+		return false;
+	if (scratch->capacity<m->dfa_count+1)
+	{
+		scratch->capacity=m->dfa_count+1;
+		scratch->threads=realloc(scratch->threads, sizeof(struct matcher_thread)*scratch->capacity);
+		scratch->next=realloc(scratch->next, sizeof(struct matcher_thread)*scratch->capacity);
+		scratch->mark=realloc(scratch->mark, sizeof(int)*scratch->capacity);
+		memset(scratch->mark, 0, sizeof(int)*scratch->capacity);
+		scratch->step=0;
+	}
+	int count=0; // alive candidates, ordered by start
+	bool found=false;
+	size_t best_start=0, best_end=0;
+	for (size_t i=from;;++i)
+	{
+		if (count==0)
+		{
+			if (found || i>=len || (m->bol_only && i>0))
+				break;
+			//prefilter: jump to the next place the literal prefix or a possible first byte occurs
+			if (m->prefix_len>1)
+			{
+				const char *hit=memmem(line+i, len-i, m->prefix, m->prefix_len);
+				if (hit==NULL)
+					break;
+				i=hit-line;
+			}
+			else
+				while (i<len && !m->first_byte[s[i]])
+					i++;
+			if (i>=len || (m->bol_only && i>0))
+				break;
+		}
+		if (scratch->step==INT_MAX)
+		{
+			memset(scratch->mark, 0, sizeof(int)*scratch->capacity);
+			scratch->step=0;
+		}
+		int step=++scratch->step;
+		//the candidate starting here comes last, it loses to every earlier one in the same state
+		if (!found && i<len && (!m->bol_only || i==0) && (!m->whole_word || i==0 || !is_word_byte(s[i-1])))
+			scratch->threads[count++]=(struct matcher_thread){i==0 ? m->bol_start : 0, i};
+		if (i>=len)
+			break;
+		int next_count=0;
+		unsigned char c=m->byte_class[s[i]];
+		bool end_ok=!m->whole_word || i+1==len || !is_word_byte(s[i+1]);
+		for (int t=0;t<count;++t)
+		{
+			int state=m->transitions[scratch->threads[t].state*m->class_count+c];
+			if (state==-1 || scratch->mark[state]==step)
+				continue;
+			scratch->mark[state]=step;
+			size_t candidate=scratch->threads[t].start;
+			if (found && candidate>best_start)
+				continue; // a match further left is already known
+			scratch->next[next_count++]=(struct matcher_thread){state, candidate};
+			if ((m->accepting[state] || (i+1==len && m->accepting_end[state])) && end_ok && (!found || candidate<best_start || i+1>best_end))
+			{
+				found=true;
+				best_start=candidate;
+				best_end=i+1;
+			}
+		}
+		struct matcher_thread *swap=scratch->threads;
+		scratch->threads=scratch->next;
+		scratch->next=swap;
+		count=next_count;
+	}
+	if (found)
+	{
+		*start=best_start;
+		*end=best_end;
+	}
+	return found;
+}
+//highlight over many files: every file is mmap'd and split into line-aligned chunks that are
+//scanned on the pool, the shell thread prints each file's chunks in order once they are done
+#define HIGHLIGHT_CHUNK_BYTES (4*1024*1024)
+#define HIGHLIGHT_FILES_IN_FLIGHT 256 // files mapped at the same time
+struct highlight_options {
+	const char *word;
+	const char *color;
+	bool regex; // -e, the word is a pattern
+	bool case_sensitive; // -s, -i turns it back off
+	bool whole_word; // -w, always on for plain words
+	struct matcher matcher; // compiled word
+	bool line_numbers; // -n
+	bool count_only; // -c
+	bool recursive; // -r
+	bool file_names; // -H, also on with several files or -r
+	struct json_writer *json; // --json and --ndjson, NULL for highlighted text
+};
+struct highlight_match_line {
+	long line; // line number inside the chunk, from 0
+	size_t offset; // where the highlighted line starts in the chunk's output
+};
+struct highlight_chunk {
+	const struct highlight_options *options;
+	const char *start, *end;
+	long lines; // lines in the chunk
+	struct out_buf out; // highlighted matching lines
+	struct highlight_match_line *matches;
+	int match_count, match_capacity;
+	struct highlight_file *file;
+};
+struct highlight_file {
+	char *path;
+	char *data;
+	size_t size;
+	int chunk_count;
+	struct highlight_chunk *chunks;
+	int remaining; // chunks not scanned yet, guarded by highlight_lock
+};
+pthread_mutex_t highlight_lock=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t highlight_done=PTHREAD_COND_INITIALIZER;
+const char *highlight_color_code(const char *color)
+{
+	if (strcmp(color, "r")==0) return "\033[0;31m"; //to write in red
+	if (strcmp(color, "g")==0) return "\033[32m"; //to write in green
+	if (strcmp(color, "b")==0) return "\033[0;34m"; //to write in blue
+	return "";
+}
+/**
+ * Highlights the occurrences of the word in one line
+ * @return true if the line has the word, its highlighted copy is then appended to out
+ */
+bool highlight_line(const struct highlight_options *options, const char *line, size_t len, struct out_buf *out)
+{
+	if (len>0 && line[len-1]=='\n')
+		len--;
+	size_t printed=0, start, end, from=0;
+	bool found=false;
+	while (from<len && matcher_find(&options->matcher, line, len, from, &start, &end))
+	{
+		found=true;
+		if (options->count_only)
+			return true;
+		out_append(out, line+printed, start-printed);
+		out_puts(out, highlight_color_code(options->color));
+		out_append(out, line+start, end-start);
+		out_puts(out, "\033[0m"); //reset the color
+		printed=from=end;
+	}
+	if (found)
+	{
+		out_append(out, line+printed, len-printed);
+		out_append(out, "\n", 1);
+	}
+	return found;
+}
+/**
+ * Writes the members of a match record that follow its file and line: the line's byte offset, its
+ * text and the [start, end) span of every match in it
+ * @return true if the line matches
+ */
+bool highlight_json_line(const struct highlight_options *options, const char *line, size_t len, size_t offset, struct out_buf *out)
+{
+	if (len>0 && line[len-1]=='\n')
+		len--;
+	struct json_out json={out, 1, {false}}; // continues a record the caller has started
+	size_t start, end, from=0;
+	bool found=false;
+	while (from<len && matcher_find(&options->matcher, line, len, from, &start, &end))
+	{
+		if (!found)
+		{
+			if (options->count_only)
+				return true;
+			json_number(&json, "offset", offset);
+			json_string(&json, "text", line, len);
+			json_open(&json, "matches", '[');
+			found=true;
+		}
+		json_open(&json, NULL, '[');
+		json_number(&json, NULL, start);
+		json_number(&json, NULL, end);
+		json_close(&json, ']');
+		from=end>start ? end : end+1;
+	}
+	if (found)
+		json_close(&json, ']');
+	return found;
+}
+/**
+ * Writes a match record from the members highlight_json_line left in out
+ */
+void highlight_json_record(struct json_writer *writer, const char *name, long line_number, const char *members, size_t len)
+{
+	struct json_out *json=json_record(writer);
+	json_string(json, "file", name, strlen(name));
+	json_number(json, "line", line_number);
+	out_append(json->out, members, len);
+	json_record_end(writer);
+}
+/**
+ * Writes the match count record of -c
+ */
+void highlight_json_count(struct json_writer *writer, const char *name, long count)
+{
+	struct json_out *json=json_record(writer);
+	json_string(json, "file", name, strlen(name));
+	json_number(json, "count", count);
+	json_record_end(writer);
+}
+void highlight_scan_chunk(void *arg)
+{
+	struct highlight_chunk *chunk=arg;
+	const char *p=chunk->start;
+	while (p<chunk->end)
+	{
+		const char *nl=memchr(p, '\n', chunk->end-p);
+		const char *next=nl ? nl+1 : chunk->end;
+		size_t offset=chunk->out.len;
+		if (chunk->options->json ? highlight_json_line(chunk->options, p, next-p, p-chunk->file->data, &chunk->out)
+			: highlight_line(chunk->options, p, next-p, &chunk->out))
+		{
+			if (chunk->match_count==chunk->match_capacity)
+			{
+				chunk->match_capacity=chunk->match_capacity ? chunk->match_capacity*2 : 16;
+				chunk->matches=realloc(chunk->matches, sizeof(struct highlight_match_line)*chunk->match_capacity);
+			}
+			chunk->matches[chunk->match_count++]=(struct highlight_match_line){chunk->lines, offset};
+		}
+		chunk->lines++;
+		p=next;
+	}
+	pthread_mutex_lock(&highlight_lock);
+	if (--chunk->file->remaining==0)
+		pthread_cond_broadcast(&highlight_done);
+	pthread_mutex_unlock(&highlight_lock);
+}
+/**
+ * Maps a file and queues its chunks on the pool
+ * @return false if the file cannot be read
+ */
+bool highlight_start_file(struct highlight_file *file, const struct highlight_options *options)
+{
+	int fd=open(file->path, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd==-1 || fstat(fd, &st)==-1)
+	{
+		printf("-%s: highlight: %s: %s\n", sysname, file->path, strerror(errno));
+		if (fd!=-1) close(fd);
+		return false;
+	}
+	file->size=st.st_size;
+	file->data=NULL;
+	if (file->size>0)
+	{
+		file->data=mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->data==MAP_FAILED)
+		{
+			printf("-%s: highlight: %s: %s\n", sysname, file->path, strerror(errno));
+			close(fd);
+			return false;
+		}
+		madvise(file->data, file->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	file->chunk_count=file->size/HIGHLIGHT_CHUNK_BYTES+1;
+	file->chunks=calloc(file->chunk_count, sizeof(struct highlight_chunk));
+	//chunk boundaries are moved forward to the next line start
+	const char *start=file->data, *end=file->data+file->size;
+	int count=0;
+	while (count<file->chunk_count)
+	{
+		const char *chunk_end=end;
+		if (count<file->chunk_count-1 && end-start>HIGHLIGHT_CHUNK_BYTES)
+		{
+			const char *nl=memchr(start+HIGHLIGHT_CHUNK_BYTES, '\n', end-start-HIGHLIGHT_CHUNK_BYTES);
+			chunk_end=nl ? nl+1 : end;
+		}
+		file->chunks[count]=(struct highlight_chunk){.options=options, .start=start, .end=chunk_end, .file=file};
+		count++;
+		start=chunk_end;
+		if (start==end)
+			break;
+	}
+	file->chunk_count=count;
+	file->remaining=count;
+	struct thread_pool *pool=pool_get();
+	for (int i=0;i<count;++i)
+		pool_submit(pool, highlight_scan_chunk, &file->chunks[i]);
+	return true;
+}
+/**
+ * Waits for a file's chunks and prints them in order, then releases the file
+ */
+void highlight_finish_file(struct highlight_file *file, const struct highlight_options *options)
+{
+	pthread_mutex_lock(&highlight_lock);
+	while (file->remaining>0)
+		pthread_cond_wait(&highlight_done, &highlight_lock);
+	pthread_mutex_unlock(&highlight_lock);
+	long base=0, count=0;
+	for (int i=0;i<file->chunk_count;++i)
+	{
+		struct highlight_chunk *chunk=&file->chunks[i];
+		for (int j=0;j<chunk->match_count && !options->count_only;++j)
+		{
+			size_t end=j+1<chunk->match_count ? chunk->matches[j+1].offset : chunk->out.len;
+			if (options->json)
+			{
+				highlight_json_record(options->json, file->path, base+chunk->matches[j].line+1,
+					chunk->out.data+chunk->matches[j].offset, end-chunk->matches[j].offset);
+				continue;
+			}
+			if (options->file_names)
+				printf("%s:", file->path);
+			if (options->line_numbers)
+				printf("%ld:", base+chunk->matches[j].line+1);
+			fwrite(chunk->out.data+chunk->matches[j].offset, 1, end-chunk->matches[j].offset, stdout);
+		}
+		count+=chunk->match_count;
+		base+=chunk->lines;
+		free(chunk->out.data);
+		free(chunk->matches);
+	}
+	if (options->count_only && options->json)
+		highlight_json_count(options->json, file->path, count);
+	else if (options->count_only)
+	{
+		if (options->file_names)
+			printf("%s:", file->path);
+		printf("%ld\n", count);
+	}
+	if (file->data)
+		munmap(file->data, file->size);
+	free(file->chunks);
+	free(file->path);
+}
+/**
+ * Collects the regular files under a path, directories are walked in name order with -r
+ */
+void highlight_collect(const char *path, const struct highlight_options *options,
+	char ***paths, int *count, int *capacity)
+{
+	struct stat st;
+	if (stat(path, &st)==-1)
+	{
+		printf("-%s: highlight: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+	if (S_ISDIR(st.st_mode))
+	{
+		if (!options->recursive)
+		{
+			printf("-%s: highlight: %s: Is a directory\n", sysname, path);
+			return;
+		}
+		struct dirent **entries;
+		int n=scandir(path, &entries, NULL, alphasort);
+		for (int i=0;i<n;++i)
+		{
+			if (strcmp(entries[i]->d_name, ".")!=0 && strcmp(entries[i]->d_name, "..")!=0)
+			{
+				char *child;
+				if (asprintf(&child, "%s/%s", path, entries[i]->d_name)!=-1)
+				{
+					highlight_collect(child, options, paths, count, capacity);
+					free(child);
+				}
+			}
+			free(entries[i]);
+		}
+		if (n>=0) free(entries);
+		return;
+	}
+	if (!S_ISREG(st.st_mode))
+		return;
+	if (*count==*capacity)
+	{
+		*capacity=*capacity ? *capacity*2 : 64;
+		*paths=realloc(*paths, sizeof(char *)*(*capacity));
+	}
+	(*paths)[(*count)++]=strdup(path);
+}
+/**
+ * Highlights the word in every file, keeping HIGHLIGHT_FILES_IN_FLIGHT files scanned ahead
+ * of the one being printed
+ */
+void highlight_files(char **args, int arg_count, struct highlight_options *options)
+{
+	char **paths=NULL;
+	int count=0, capacity=0;
+	for (int i=0;i<arg_count;++i)
+		highlight_collect(args[i], options, &paths, &count, &capacity);
+	if (count>1 || options->recursive)
+		options->file_names=true;
+	struct highlight_file *files=calloc(count ? count : 1, sizeof(struct highlight_file));
+	bool *started=calloc(count ? count : 1, sizeof(bool));
+	int next=0;
+	for (int i=0;i<count;++i)
+	{
+		for (;next<count && next<i+HIGHLIGHT_FILES_IN_FLIGHT;++next)
+		{
+			files[next].path=paths[next];
+			started[next]=highlight_start_file(&files[next], options);
+		}
+		if (started[i])
+			highlight_finish_file(&files[i], options);
+		else
+			free(files[i].path);
+	}
+	fflush(stdout);
+	free(started);
+	free(files);
+	free(paths);
+}
+#define HIGHLIGHT_STREAM_BLOCK (64*1024) // matching lines are written out in blocks of this size
+#define HIGHLIGHT_STREAM_MAX_LINE (1024*1024) // longer lines are highlighted in pieces
+/**
+ * Highlights a stream as a filter: reads it through the shared reader, writes the matching lines as they
+ * complete and flushes per line only when stdout is a terminal. Memory stays bounded by
+ * HIGHLIGHT_STREAM_MAX_LINE whatever the input size.
+ * @param fd   input descriptor
+ * @param name name shown with -H
+ */
+void highlight_stream(int fd, const char *name, const struct highlight_options *options)
+{
+	struct reader reader;
+	reader_init(&reader, fd);
+	reader.max_line=HIGHLIGHT_STREAM_MAX_LINE;
+	struct out_buf out={0};
+	bool interactive=isatty(STDOUT_FILENO);
+	long line_number=0, count=0;
+	size_t offset=0; // of the line in the stream
+	bool line_start=true, line_counted=false;
+	char *line;
+	size_t len;
+	while (reader_line(&reader, &line, &len))
+	{
+		//a line longer than max_line comes in pieces, numbered and counted once
+		if (line_start)
+		{
+			line_number++;
+			line_counted=false;
+		}
+		line_start=reader.newline;
+		size_t line_offset=offset;
+		offset+=len+reader.newline;
+		if (options->json)
+		{
+			if (!highlight_json_line(options, line, len, line_offset, &out))
+				continue;
+			count+=!line_counted;
+			line_counted=true;
+			if (!options->count_only)
+				highlight_json_record(options->json, name, line_number, out.data, out.len);
+			if (interactive)
+				json_flush(options->json), fflush(stdout);
+			out.len=0;
+			continue;
+		}
+		if (options->count_only)
+		{
+			if (!line_counted && highlight_line(options, line, len, &out))
+			{
+				count++;
+				line_counted=true;
+			}
+			continue;
+		}
+		size_t before=out.len;
+		if (options->file_names)
+			out_puts(&out, name), out_puts(&out, ":");
+		if (options->line_numbers)
+		{
+			char number[32];
+			snprintf(number, sizeof(number), "%ld:", line_number);
+			out_puts(&out, number);
+		}
+		if (!highlight_line(options, line, len, &out))
+			out.len=before;
+		else if (interactive || out.len>=HIGHLIGHT_STREAM_BLOCK)
+		{
+			fwrite(out.data, 1, out.len, stdout);
+			if (interactive)
+				fflush(stdout);
+			out.len=0;
+		}
+	}
+	if (out.len>0)
+		fwrite(out.data, 1, out.len, stdout);
+	if (options->count_only && options->json)
+		highlight_json_count(options->json, name, count);
+	else if (options->count_only)
+	{
+		if (options->file_names)
+			printf("%s:", name);
+		printf("%ld\n", count);
+	}
+	fflush(stdout);
+	free(out.data);
+	reader_close(&reader);
+}
+
+bool snapshot_find_command(const char *name, char *buf, size_t size);
+void snapshot_refresh_background();
+/**
+ * Finds an executable in the PATH directories, like which but without the extra process
+ * @param  name command name
+ * @param  buf  resolved path
+ * @param  size size of buf
+ * @return      true if found
+ */
+bool find_in_path(const char *name, char *buf, size_t size)
+{
+	if (strchr(name, '/'))
+	{
+		snprintf(buf, size, "%s", name);
+		return access(buf, X_OK)==0;
+	}
+	if (snapshot_find_command(name, buf, size))
+		return true;
+	snapshot_refresh_background(); // a miss may mean the snapshot is stale
+	const char *path=getenv("PATH");
+	while (path && *path)
+	{
+		size_t len=strcspn(path, ":");
+		snprintf(buf, size, "%.*s/%s", (int)(len ? len : 1), len ? path : ".", name);
+		struct stat st;
+		if (access(buf, X_OK)==0 && stat(buf, &st)==0 && S_ISREG(st.st_mode))
+			return true;
+		path+=len;
+		if (*path==':') path++;
+	}
+	return false;
+}
+/**
+ * Replaces the current process with the command, never returns
+ * @param command command to execute
+ */
+void exec_command(struct command_t *command)
+{
+	// add a NULL argument to the end of args, and the name to the beginning
+	// as required by exec
+	char **args=malloc(sizeof(char *)*(command->arg_count+2));
+	args[0]=command->name;
+	for (int i=0;i<command->arg_count;++i)
+		args[i+1]=command->args[i];
+	args[command->arg_count+1]=NULL;
+
+	//resolves the command in PATH and executes it (Part I)
+	char path[4096];
+	if (find_in_path(command->name, path, sizeof(path)))
+		execv(path, args);
+	printf("-%s: %s: command not found\n", sysname, command->name);
+	fflush(stdout);
+	_exit(127);
+}
+//in-process cat, wc, head and tail, shadowing the external ones when the fastutils option is on.
+//Anything with flags they do not know falls back to the real binary.
+/**
+ * Counts the newlines in a buffer, 16 bytes at a time with SSE2 when available
+ */
+size_t count_newlines(const char *data, size_t len)
+{
+	size_t count=0, i=0;
+#ifdef __SSE2__
+	const __m128i newline=_mm_set1_epi8('\n');
+	for (;i+16<=len;i+=16)
+	{
+		__m128i block=_mm_loadu_si128((const __m128i *)(data+i));
+		count+=__builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+	}
+#endif
+	for (;i<len;++i)
+		count+=data[i]=='\n';
+	return count;
+}
+/**
+ * Copies a descriptor to another one, in the kernel with sendfile when it can
+ * @return 0 on success, -1 on error
+ */
+int copy_fd(int in, int out)
+{
+	struct stat st;
+	if (fstat(in, &st)==0 && S_ISREG(st.st_mode))
+	{
+		ssize_t n;
+		while ((n=sendfile(out, in, NULL, 1<<30))>0) ;
+		if (n==0)
+			return 0;
+		if (errno!=EINVAL && errno!=ENOSYS)
+			return -1;
+	}
+	static char buf[128*1024];
+	ssize_t n;
+	while ((n=read(in, buf, sizeof(buf)))!=0)
+	{
+		if (n==-1)
+		{
+			if (errno==EINTR) continue;
+			return -1;
+		}
+		for (ssize_t done=0;done<n;)
+		{
+			ssize_t w=write(out, buf+done, n-done);
+			if (w==-1)
+			{
+				if (errno==EINTR) continue;
+				return -1;
+			}
+			done+=w;
+		}
+	}
+	return 0;
+}
+void write_all(int fd, const char *data, size_t len)
+{
+	while (len>0)
+	{
+		ssize_t n=write(fd, data, len);
+		if (n==-1)
+		{
+			if (errno==EINTR) continue;
+			return;
+		}
+		data+=n;
+		len-=n;
+	}
+}
+/**
+ * Opens a file argument, - is stdin
+ * @return descriptor, -1 after printing the error
+ */
+int fastutil_open(const char *name, const char *path)
+{
+	if (strcmp(path, "-")==0)
+		return STDIN_FILENO;
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+		fprintf(stderr, "%s: %s: %s\n", name, path, strerror(errno));
+	return fd;
+}
+void fastutil_close(int fd)
+{
+	if (fd!=STDIN_FILENO)
+		close(fd);
+}
+/**
+ * Reads a whole descriptor, mapping it when it is a regular file
+ * @return the data (release with fastutil_release), NULL for empty or unreadable input
+ */
+char *fastutil_load(int fd, size_t *len, bool *mapped)
+{
+	struct stat st;
+	*len=0;
+	*mapped=false;
+	if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0)
+	{
+		char *data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data!=MAP_FAILED)
+		{
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			*len=st.st_size;
+			*mapped=true;
+			return data;
+		}
+	}
+	size_t capacity=0;
+	char *data=NULL;
+	ssize_t n;
+	do
+	{
+		if (*len==capacity)
+		{
+			capacity=capacity ? capacity*2 : 64*1024;
+			data=realloc(data, capacity);
+		}
+		n=read(fd, data+*len, capacity-*len);
+		if (n>0) *len+=n;
+	} while (n>0 || (n==-1 && errno==EINTR));
+	return data;
+}
+void fastutil_release(char *data, size_t len, bool mapped)
+{
+	if (mapped)
+		munmap(data, len);
+	else
+		free(data);
+}
+/**
+ * Reads a -n N or -N line count option. Only plain digits are taken: tail -n +N (from line N on)
+ * and head -n -N (all but the last N) are left to the real binaries.
+ * @return number of arguments consumed, -1 if the option is not supported
+ */
+int fastutil_line_option(char **args, int count, long *lines)
+{
+	if (count>0 && strcmp(args[0], "-n")==0 && count>1)
+	{
+		char *end;
+		if (!isdigit((unsigned char)args[1][0]))
+			return -1;
+		*lines=strtol(args[1], &end, 10);
+		return *end==0 ? 2 : -1;
+	}
+	if (count>0 && args[0][0]=='-' && isdigit(args[0][1]))
+	{
+		char *end;
+		*lines=strtol(args[0]+1, &end, 10);
+		return *end==0 ? 1 : -1;
+	}
+	return 0;
+}
+void fastutil_wc_print(long counts[3], bool show[3], int width, const char *name)
+{
+	char line[256];
+	int len=0;
+	bool first=true;
+	for (int i=0;i<3;++i)
+		if (show[i])
+		{
+			len+=snprintf(line+len, sizeof(line)-len, first ? "%*ld" : " %*ld", width, counts[i]);
+			first=false;
+		}
+	if (name)
+		len+=snprintf(line+len, sizeof(line)-len, " %s", name);
+	len+=snprintf(line+len, sizeof(line)-len, "\n");
+	fwrite(line, 1, len, stdout);
+}
+/**
+ * Runs cat, wc, head or tail in the shell process
+ * @return true if it was handled, false to run the external command instead
+ */
+bool fastutil_run(struct command_t *command)
+{
+	const char *name=command->name;
+	char **args=command->args;
+	int count=command->arg_count;
+	char *stdin_only[]={"-"};
+	if (strcmp(name, "cat")==0)
+	{
+		for (int i=0;i<count;++i)
+			if (args[i][0]=='-' && args[i][1])
+				return false;
+		fflush(stdout);
+		if (count==0)
+		{
+			args=stdin_only;
+			count=1;
+		}
+		for (int i=0;i<count;++i)
+		{
+			int fd=fastutil_open(name, args[i]);
+			if (fd==-1)
+				continue;
+			if (copy_fd(fd, STDOUT_FILENO)==-1)
+				fprintf(stderr, "%s: %s: %s\n", name, args[i], strerror(errno));
+			fastutil_close(fd);
+		}
+		return true;
+	}
+	if (strcmp(name, "wc")==0)
+	{
+		bool show[3]={false, false, false}; // lines, words, bytes
+		int first=0;
+		for (;first<count && args[first][0]=='-' && args[first][1];++first)
+			for (char *flag=args[first]+1;*flag;++flag)
+			{
+				if (*flag=='l') show[0]=true;
+				else if (*flag=='w') show[1]=true;
+				else if (*flag=='c') show[2]=true;
+				else return false;
+			}
+		if (!show[0] && !show[1] && !show[2])
+			show[0]=show[1]=show[2]=true;
+		int shown=show[0]+show[1]+show[2];
+		bool named=first<count;
+		if (!named)
+		{
+			args=stdin_only;
+			count=1;
+			first=0;
+		}
+		//column width from the total size, like coreutils
+		int width=1;
+		if (shown>1 || count-first>1)
+		{
+			long long total=0;
+			struct stat st;
+			for (int i=first;i<count;++i)
+				if (strcmp(args[i], "-")==0 || stat(args[i], &st)!=0 || !S_ISREG(st.st_mode))
+					total=9999999;
+				else
+					total+=st.st_size;
+			for (;total>=10;total/=10) width++;
+		}
+		long totals[3]={0, 0, 0};
+		for (int i=first;i<count;++i)
+		{
+			int fd=fastutil_open(name, args[i]);
+			if (fd==-1)
+				continue;
+			long counts[3]={0, 0, 0};
+			struct stat st;
+			if (!show[0] && !show[1] && fstat(fd, &st)==0 && S_ISREG(st.st_mode))
+				counts[2]=st.st_size; // bytes only, no need to read
+			else
+			{
+				size_t len;
+				bool mapped;
+				char *data=fastutil_load(fd, &len, &mapped);
+				counts[0]=count_newlines(data, len);
+				counts[2]=len;
+				if (show[1])
+				{
+					bool in_word=false;
+					for (size_t j=0;j<len;++j)
+					{
+						bool space=isspace((unsigned char)data[j]);
+						if (!space && !in_word) counts[1]++;
+						in_word=!space;
+					}
+				}
+				fastutil_release(data, len, mapped);
+			}
+			fastutil_close(fd);
+			fastutil_wc_print(counts, show, width, named ? args[i] : NULL);
+			for (int k=0;k<3;++k)
+				totals[k]+=counts[k];
+		}
+		if (count-first>1)
+			fastutil_wc_print(totals, show, width, "total");
+		fflush(stdout);
+		return true;
+	}
+	if (strcmp(name, "head")==0 || strcmp(name, "tail")==0)
+	{
+		long lines=10;
+		int first=fastutil_line_option(args, count, &lines);
+		if (first==-1)
+			return false;
+		for (int i=first;i<count;++i)
+			if (args[i][0]=='-' && args[i][1])
+				return false;
+		bool headers=count-first>1;
+		if (first==count)
+		{
+			args=stdin_only;
+			count=1;
+			first=0;
+		}
+		fflush(stdout);
+		for (int i=first;i<count;++i)
+		{
+			int fd=fastutil_open(name, args[i]);
+			if (fd==-1)
+				continue;
+			if (headers)
+			{
+				char header[4200];
+				int len=snprintf(header, sizeof(header), "%s==> %s <==\n", i>first ? "\n" : "", args[i]);
+				write_all(STDOUT_FILENO, header, len);
+			}
+			if (name[0]=='h')
+			{
+				//reads blocks until enough newlines went by
+				static char buf[128*1024];
+				long seen=0;
+				ssize_t n;
+				while (seen<lines && (n=read(fd, buf, sizeof(buf)))>0)
+				{
+					size_t end=0;
+					while (seen<lines && end<(size_t)n)
+					{
+						char *nl=memchr(buf+end, '\n', n-end);
+						end=nl ? (size_t)(nl-buf)+1 : (size_t)n;
+						if (nl) seen++;
+					}
+					write_all(STDOUT_FILENO, buf, end);
+				}
+			}
+			else
+			{
+				//scans backwards from the end for the newlines
+				size_t len;
+				bool mapped;
+				char *data=fastutil_load(fd, &len, &mapped);
+				size_t start=len;
+				long seen=0;
+				if (start>0 && data[start-1]=='\n')
+					start--; // the final newline ends the last line
+				while (start>0)
+				{
+					char *nl=memrchr(data, '\n', start);
+					if (nl==NULL)
+					{
+						start=0;
+						break;
+					}
+					if (++seen>lines-1 || lines==0)
+					{
+						start=nl-data+1;
+						break;
+					}
+					start=nl-data;
+				}
+				if (lines==0)
+					start=len;
+				write_all(STDOUT_FILENO, data+start, len-start);
+				fastutil_release(data, len, mapped);
+			}
+			fastutil_close(fd);
+		}
+		return true;
+	}
+	return false;
+}
+//warm-start snapshot: the command table of the PATH directories, the shortdir aliases and the newest
+//history entries are written to ~/.seashell_cache.<PATH hash> and mapped read-only by new sessions.
+//Every section records what it was built from (PATH directory mtimes, shortdir and history sizes) and
+//is only used while that still holds; a stale snapshot is rebuilt by a background child.
+#define SNAPSHOT_MAGIC "SSHSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HISTORY_ENTRIES 100
+#define SNAPSHOT_HISTORY_MAX_BEHIND (64*1024) // history bytes appended after the snapshot before it is rebuilt
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t path_hash;
+	uint64_t strings_offset, strings_size;
+	//PATH directories and the commands found in them
+	uint64_t dirs_offset;
+	uint32_t dir_count;
+	uint32_t command_slots; // power of two
+	uint64_t commands_offset;
+	//shortdir aliases
+	int64_t shortdir_size, shortdir_mtime_sec, shortdir_mtime_nsec;
+	uint64_t aliases_offset;
+	uint32_t alias_count;
+	uint32_t history_count;
+	//newest history entries
+	int64_t history_size;
+	int64_t history_inode;
+	uint64_t history_offset;
+};
+struct snapshot_dir {
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t name; // offset into strings
+	uint32_t reserved;
+};
+struct snapshot_command {
+	uint64_t hash;
+	uint32_t name; // offset into strings, 0 for an empty slot
+	uint32_t dir;
+};
+struct snapshot_pair {
+	uint32_t key, value; // offsets into strings
+};
+struct {
+	const char *data;
+	size_t size;
+	const struct snapshot_header *header;
+	bool path_valid, shortdir_valid, history_valid;
+	bool rebuilding;
+} snapshot;
+void snapshot_file(char *buf, size_t size)
+{
+	const char *path=getenv("PATH");
+	snprintf(buf, size, "%s/.seashell_cache.%016llx", getenv("HOME"),
+		(unsigned long long)fnv1a(path ? path : "", path ? strlen(path) : 0));
+}
+const char *snapshot_string(uint32_t offset)
+{
+	return snapshot.data+snapshot.header->strings_offset+offset;
+}
+/**
+ * Whether a section of count entries at offset lies within the mapping, aligned for its entries
+ */
+bool snapshot_section_fits(uint64_t offset, uint64_t count, size_t entry, size_t align)
+{
+	return offset%align==0 && offset<=snapshot.size && count<=(snapshot.size-offset)/entry;
+}
+/**
+ * Checks that every offset and count of the snapshot stays inside it, so a truncated or
+ * corrupt file is dropped instead of being read out of bounds
+ */
+bool snapshot_check()
+{
+	const struct snapshot_header *h=snapshot.header;
+	const char *path=getenv("PATH");
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, 8)!=0 || h->version!=SNAPSHOT_VERSION
+		|| h->header_size!=sizeof(struct snapshot_header)
+		|| h->path_hash!=fnv1a(path ? path : "", path ? strlen(path) : 0))
+		return false;
+	//every string ends with a NUL inside the section
+	if (!snapshot_section_fits(h->strings_offset, h->strings_size, 1, 1) || h->strings_size==0
+		|| snapshot.data[h->strings_offset+h->strings_size-1]!=0)
+		return false;
+	if (h->command_slots==0 || (h->command_slots&(h->command_slots-1))!=0
+		|| !snapshot_section_fits(h->dirs_offset, h->dir_count, sizeof(struct snapshot_dir), 8)
+		|| !snapshot_section_fits(h->commands_offset, h->command_slots, sizeof(struct snapshot_command), 8)
+		|| !snapshot_section_fits(h->aliases_offset, h->alias_count, sizeof(struct snapshot_pair), 4)
+		|| !snapshot_section_fits(h->history_offset, h->history_count, sizeof(uint32_t), 4))
+		return false;
+	const struct snapshot_dir *dirs=(const void *)(snapshot.data+h->dirs_offset);
+	for (uint32_t i=0;i<h->dir_count;++i)
+		if (dirs[i].name>=h->strings_size)
+			return false;
+	//a full table would never end a probe
+	uint32_t empty=0;
+	const struct snapshot_command *commands=(const void *)(snapshot.data+h->commands_offset);
+	for (uint32_t i=0;i<h->command_slots;++i)
+	{
+		if (commands[i].name==0)
+			empty++;
+		else if (commands[i].name>=h->strings_size || commands[i].dir>=h->dir_count)
+			return false;
+	}
+	if (empty==0)
+		return false;
+	const struct snapshot_pair *pairs=(const void *)(snapshot.data+h->aliases_offset);
+	for (uint32_t i=0;i<h->alias_count;++i)
+		if (pairs[i].key>=h->strings_size || pairs[i].value>=h->strings_size)
+			return false;
+	const uint32_t *entries=(const void *)(snapshot.data+h->history_offset);
+	for (uint32_t i=0;i<h->history_count;++i)
+		if (entries[i]>=h->strings_size)
+			return false;
+	return true;
+}
+/**
+ * Whether the snapshot's aliases still match the shortdir file, checked on every use since
+ * this and other sessions rewrite the file
+ */
+bool snapshot_shortdir_current()
+{
+	const struct snapshot_header *h=snapshot.header;
+	char file_path[512];
+	struct stat st;
+	home_path(file_path, sizeof(file_path), "shortdir");
+	return stat(file_path, &st)==0 ? st.st_size==h->shortdir_size && st.st_mtim.tv_sec==h->shortdir_mtime_sec
+		&& st.st_mtim.tv_nsec==h->shortdir_mtime_nsec : h->shortdir_size==-1;
+}
+/**
+ * Maps the snapshot and checks which of its sections are still valid
+ */
+void snapshot_open()
+{
+	char file[600];
+	snapshot_file(file, sizeof(file));
+	int fd=open(file, O_RDONLY|O_CLOEXEC);
+	struct stat st;
+	if (fd==-1)
+		return;
+	if (fstat(fd, &st)==0 && st.st_size>=(off_t)sizeof(struct snapshot_header))
+	{
+		void *data=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data!=MAP_FAILED)
+		{
+			snapshot.data=data;
+			snapshot.size=st.st_size;
+			snapshot.header=data;
+		}
+	}
+	close(fd);
+	const struct snapshot_header *h=snapshot.header;
+	if (h==NULL)
+		return;
+	if (!snapshot_check())
+	{
+		munmap((void *)snapshot.data, snapshot.size);
+		memset(&snapshot, 0, sizeof(snapshot));
+		return;
+	}
+	//the command table is valid while no PATH directory changed
+	snapshot.path_valid=true;
+	const struct snapshot_dir *dirs=(const void *)(snapshot.data+h->dirs_offset);
+	for (uint32_t i=0;i<h->dir_count && snapshot.path_valid;++i)
+		snapshot.path_valid=stat(snapshot_string(dirs[i].name), &st)==0 && st.st_mtim.tv_sec==dirs[i].mtime_sec
+			&& st.st_mtim.tv_nsec==dirs[i].mtime_nsec;
+	snapshot.shortdir_valid=snapshot_shortdir_current();
+	char file_path[512];
+	history_path(file_path, sizeof(file_path), 0);
+	//history only grows between rotations, the entries appended since are read on load
+	snapshot.history_valid=stat(file_path, &st)==0 && st.st_size>=h->history_size && (int64_t)st.st_ino==h->history_inode
+		&& st.st_size-h->history_size<SNAPSHOT_HISTORY_MAX_BEHIND;
+}
+/**
+ * Looks a command up in the snapshot's PATH table
+ * @return true if found, false if missing or the table is stale
+ */
+bool snapshot_find_command(const char *name, char *buf, size_t size)
+{
+	if (!snapshot.path_valid)
+		return false;
+	const struct snapshot_header *h=snapshot.header;
+	const struct snapshot_command *commands=(const void *)(snapshot.data+h->commands_offset);
+	const struct snapshot_dir *dirs=(const void *)(snapshot.data+h->dirs_offset);
+	uint64_t hash=fnv1a(name, strlen(name));
+	for (uint32_t i=hash&(h->command_slots-1);commands[i].name!=0;i=(i+1)&(h->command_slots-1))
+		if (commands[i].hash==hash && strcmp(snapshot_string(commands[i].name), name)==0)
+		{
+			snprintf(buf, size, "%s/%s", snapshot_string(dirs[commands[i].dir].name), name);
+			return true;
+		}
+	return false;
+}
+/**
+ * Fills the shortdir aliases from the snapshot
+ * @return false if the snapshot does not match the shortdir file
+ */
+bool snapshot_load_aliases(struct shortdir_map *map)
+{
+	if (snapshot.shortdir_valid && !snapshot_shortdir_current())
+		snapshot.shortdir_valid=false;
+	if (!snapshot.shortdir_valid)
+		return false;
+	const struct snapshot_pair *pairs=(const void *)(snapshot.data+snapshot.header->aliases_offset);
+	for (uint32_t i=0;i<snapshot.header->alias_count;++i)
+		shortdir_add(map, snapshot_string(pairs[i].key), snapshot_string(pairs[i].value));
+	return true;
+}
+/**
+ * Preloads the newest history entries into the recent ring, then reads the ones appended
+ * after the snapshot was taken
+ * @return false if the snapshot does not match history.txt
+ */
+bool snapshot_load_history()
+{
+	if (!snapshot.history_valid)
+		return false;
+	const uint32_t *entries=(const void *)(snapshot.data+snapshot.header->history_offset);
+	for (uint32_t i=0;i<snapshot.header->history_count;++i)
+	{
+		const char *entry=snapshot_string(entries[i]);
+		history_recent_push(entry, strlen(entry));
+	}
+	char path[512];
+	history_path(path, sizeof(path), 0);
+	history_offset=history_read_from(path, snapshot.header->history_inode, snapshot.header->history_size);
+	return true;
+}
+uint32_t snapshot_add_string(struct out_buf *strings, const char *s)
+{
+	uint32_t offset=strings->len;
+	out_append(strings, s, strlen(s)+1);
+	return offset;
+}
+/**
+ * Builds the snapshot from scratch and swaps it in
+ */
+void snapshot_build()
+{
+	struct out_buf strings={0}, dirs={0}, commands={0}, aliases={0}, history={0};
+	struct snapshot_header h={0};
+	memcpy(h.magic, SNAPSHOT_MAGIC, 8);
+	h.version=SNAPSHOT_VERSION;
+	h.header_size=sizeof(h);
+	const char *path=getenv("PATH");
+	h.path_hash=fnv1a(path ? path : "", path ? strlen(path) : 0);
+	out_append(&strings, "", 1); // offset 0 marks empty command slots
+
+	//first directory wins, like the PATH search
+	int command_count=0, command_capacity=0;
+	struct snapshot_command *found=NULL;
+	for (const char *p=path;p && *p;)
+	{
+		size_t len=strcspn(p, ":");
+		char dir[4096];
+		snprintf(dir, sizeof(dir), "%.*s", (int)(len ? len : 1), len ? p : ".");
+		p+=len;
+		if (*p==':') p++;
+		struct stat st;
+		DIR *d=opendir(dir);
+		if (d==NULL || fstat(dirfd(d), &st)!=0)
+		{
+			if (d) closedir(d);
+			continue;
+		}
+		struct snapshot_dir entry={st.st_mtim.tv_sec, st.st_mtim.tv_nsec, snapshot_add_string(&strings, dir), 0};
+		out_append(&dirs, (char *)&entry, sizeof(entry));
+		struct dirent *ent;
+		while ((ent=readdir(d))!=NULL)
+		{
+			if (ent->d_name[0]=='.' || fstatat(dirfd(d), ent->d_name, &st, 0)!=0 || !S_ISREG(st.st_mode)
+				|| !(st.st_mode&0111))
+				continue;
+			if (command_count==command_capacity)
+			{
+				command_capacity=command_capacity ? command_capacity*2 : 1024;
+				found=realloc(found, sizeof(struct snapshot_command)*command_capacity);
+			}
+			found[command_count++]=(struct snapshot_command){fnv1a(ent->d_name, strlen(ent->d_name)),
+				snapshot_add_string(&strings, ent->d_name), h.dir_count};
+		}
+		closedir(d);
+		h.dir_count++;
+	}
+	h.command_slots=16;
+	while (h.command_slots<(uint32_t)command_count*2)
+		h.command_slots*=2;
+	struct snapshot_command *slots=calloc(h.command_slots, sizeof(struct snapshot_command));
+	for (int i=0;i<command_count;++i)
+	{
+		uint32_t slot=found[i].hash&(h.command_slots-1);
+		bool duplicate=false;
+		for (;slots[slot].name!=0;slot=(slot+1)&(h.command_slots-1))
+			if (slots[slot].hash==found[i].hash && strcmp(strings.data+slots[slot].name, strings.data+found[i].name)==0)
+				duplicate=true;
+		if (!duplicate)
+			slots[slot]=found[i];
+	}
+	out_append(&commands, (char *)slots, sizeof(struct snapshot_command)*h.command_slots);
+	free(slots);
+	free(found);
+
+	//shortdir aliases, with the size and mtime they were read at
+	char file_path[512];
+	struct stat st;
+	home_path(file_path, sizeof(file_path), "shortdir");
+	h.shortdir_size=-1;
+	if (stat(file_path, &st)==0)
+	{
+		h.shortdir_size=st.st_size;
+		h.shortdir_mtime_sec=st.st_mtim.tv_sec;
+		h.shortdir_mtime_nsec=st.st_mtim.tv_nsec;
+		struct shortdir_map map={0};
+		shortdir_load(&map, file_path);
+		for (int i=0;i<map.count;++i)
+		{
+			struct snapshot_pair pair={snapshot_add_string(&strings, map.keys[i]), snapshot_add_string(&strings, map.values[i])};
+			out_append(&aliases, (char *)&pair, sizeof(pair));
+		}
+		h.alias_count=map.count;
+		shortdir_free(&map);
+	}
+
+	//newest history entries, oldest first
+	history_path(file_path, sizeof(file_path), 0);
+	int fd=open(file_path, O_RDONLY|O_CLOEXEC);
+	if (fd!=-1 && fstat(fd, &st)==0)
+	{
+		h.history_size=st.st_size;
+		h.history_inode=st.st_ino;
+		size_t len;
+		bool mapped;
+		char *data=fastutil_load(fd, &len, &mapped);
+		size_t start=len;
+		int count=0;
+		while (start>0 && count<SNAPSHOT_HISTORY_ENTRIES)
+		{
+			char *nl=memrchr(data, '\n', start-1);
+			start=nl ? (size_t)(nl-data)+1 : 0;
+			count++;
+			if (start==0) break;
+		}
+		for (char *p=data+start, *end=data+len, *nl;p<end;p=nl+1)
+		{
+			nl=memchr(p, '\n', end-p);
+			if (nl==NULL) break;
+			if (nl==p) continue;
+			uint32_t offset=strings.len;
+			out_append(&strings, p, nl-p);
+			out_append(&strings, "", 1);
+			out_append(&history, (char *)&offset, sizeof(offset));
+			h.history_count++;
+		}
+		fastutil_release(data, len, mapped);
+	}
+	if (fd!=-1)
+		close(fd);
+
+	//header, then the sections 8-byte aligned
+	struct out_buf file={0};
+	out_append(&file, (char *)&h, sizeof(h));
+	struct { struct out_buf *section; uint64_t *offset; } sections[]={
+		{&dirs, &h.dirs_offset}, {&commands, &h.commands_offset}, {&aliases, &h.aliases_offset},
+		{&history, &h.history_offset}, {&strings, &h.strings_offset}};
+	for (int i=0;i<5;++i)
+	{
+		while (file.len%8) out_append(&file, "", 1);
+		*sections[i].offset=file.len;
+		if (sections[i].section->len)
+			out_append(&file, sections[i].section->data, sections[i].section->len);
+		free(sections[i].section->data);
+	}
+	h.strings_size=strings.len;
+	memcpy(file.data, &h, sizeof(h));
+	char file_name[600], tmp_name[620];
+	snapshot_file(file_name, sizeof(file_name));
+	snprintf(tmp_name, sizeof(tmp_name), "%s.%d", file_name, getpid());
+	fd=open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd!=-1)
+	{
+		write_all(fd, file.data, file.len);
+		if (close(fd)==0)
+			rename(tmp_name, file_name);
+		else
+			remove(tmp_name);
+	}
+	free(file.data);
+}
+/**
+ * Rebuilds the snapshot in a background child, at most once per session
+ */
+void snapshot_refresh_background()
+{
+	if (snapshot.rebuilding || (snapshot.path_valid && snapshot.shortdir_valid && snapshot.history_valid))
+		return;
+	snapshot.rebuilding=true;
+	fflush(stdout);
+	if (fork()==0)
+	{
+		snapshot_build();
+		_exit(0);
+	}
+}
+
+//kdiff: line and byte comparison of two files, and -r for two directory trees. Line mode works on
+//mapped files and skips what both files share at the start and end before comparing lines. The tree walk runs on
+//the thread pool, one task per directory pair listing both sides. A file whose size differs has
+//changed and one with the same size and mtime is taken as unchanged (unless -c is given); the rest are
+//compared block by block in their own tasks while the walk goes on, stopping at the first different block.
+/**
+ * Prints one side of a different line, a missing line as an empty one
+ */
+void kdiff_print_line(const char *path, long number, const char *line, size_t len)
+{
+	printf("%s:Line %ld:", path, number);
+	if (line)
+		fwrite(line, 1, len, stdout);
+	putchar('\n');
+}
+//a run of consecutive different lines written as one --json record
+struct kdiff_hunk {
+	struct json_out *json; // record being built, NULL when no hunk is open
+	struct out_buf new_lines; // the second file's side, added when the hunk is closed
+	long count;
+};
+void kdiff_hunk_close(struct json_writer *writer, struct kdiff_hunk *hunk)
+{
+	if (!hunk->json)
+		return;
+	json_close(hunk->json, ']');
+	json_key(hunk->json, "new");
+	out_append(hunk->json->out, "[", 1);
+	out_append(hunk->json->out, hunk->new_lines.data, hunk->new_lines.len);
+	out_append(hunk->json->out, "]", 1);
+	json_number(hunk->json, "count", hunk->count);
+	json_record_end(writer);
+	hunk->json=NULL;
+	hunk->new_lines.len=0;
+	hunk->count=0;
+}
+#define KDIFF_BLOCK (64*1024) // bytes compared per memcmp while skipping common parts
+/**
+ * Length of the common prefix of two buffers, found a block at a time
+ */
+size_t kdiff_common_prefix(const char *a, const char *b, size_t n)
+{
+	size_t i=0;
+	while (i+KDIFF_BLOCK<=n && memcmp(a+i, b+i, KDIFF_BLOCK)==0)
+		i+=KDIFF_BLOCK;
+	while (i<n && a[i]==b[i])
+		i++;
+	return i;
+}
+/**
+ * Length of the common suffix of two buffers given by their ends
+ */
+size_t kdiff_common_suffix(const char *a_end, const char *b_end, size_t n)
+{
+	size_t i=0;
+	while (i+KDIFF_BLOCK<=n && memcmp(a_end-i-KDIFF_BLOCK, b_end-i-KDIFF_BLOCK, KDIFF_BLOCK)==0)
+		i+=KDIFF_BLOCK;
+	while (i<n && a_end[-1-i]==b_end[-1-i])
+		i++;
+	return i;
+}
+/**
+ * Takes the next line of a view: a pointer and a length, NUL bytes included
+ * @return false at the end of the view
+ */
+bool kdiff_next_line(const char **p, const char *end, const char **line, size_t *len, bool *newline)
+{
+	if (*p>=end)
+		return false;
+	const char *eol=memchr(*p, '\n', end-*p);
+	*line=*p;
+	*len=(eol ? eol : end)-*p;
+	*newline=eol!=NULL;
+	*p=eol ? eol+1 : end;
+	return true;
+}
+/**
+ * Compares two files line by line, printing both versions of every line that differs.
+ * Both are mapped and lines are views into them. The common prefix is skipped with block compares
+ * and so is the common suffix, when the lines left in between are as many on both sides, so that
+ * line i is still compared with line i. Only the middle is walked line by line.
+ * @param  json writer for --json and --ndjson, where runs of different lines become hunk records
+ *              with their line number and byte offsets, NULL for text
+ * @return      number of different lines, -1 if a file cannot be opened
+ */
+long kdiff_lines(const char *path1, const char *path2, struct json_writer *json)
+{
+	int fd1=open(path1, O_RDONLY|O_CLOEXEC);
+	int fd2=fd1==-1 ? -1 : open(path2, O_RDONLY|O_CLOEXEC);
+	if (fd2==-1)
+	{
+		printf("This file is not found: %s\n", fd1!=-1 ? path2 : path1);
+		if (fd1!=-1) close(fd1);
+		return -1;
+	}
+	size_t size1, size2;
+	bool mapped1, mapped2;
+	char *data1=fastutil_load(fd1, &size1, &mapped1);
+	char *data2=fastutil_load(fd2, &size2, &mapped2);
+	close(fd1);
+	close(fd2);
+
+	//back from the first different byte to the start of its line
+	size_t common=kdiff_common_prefix(data1, data2, size1<size2 ? size1 : size2);
+	const char *line_start=common ? memrchr(data1, '\n', common) : NULL;
+	size_t skipped=line_start ? line_start-data1+1 : 0;
+	long number=count_newlines(data1, skipped);
+	const char *p1=data1+skipped, *end1=data1+size1;
+	const char *p2=data2+skipped, *end2=data2+size2;
+	//forward from where the common suffix starts to the first line start both files share
+	size_t rest1=end1-p1, rest2=end2-p2;
+	size_t suffix=kdiff_common_suffix(end1, end2, rest1<rest2 ? rest1 : rest2);
+	while (suffix>0 && !((end1-suffix==p1 || end1[-suffix-1]=='\n') && (end2-suffix==p2 || end2[-suffix-1]=='\n')))
+	{
+		const char *eol=memchr(end1-suffix, '\n', suffix);
+		suffix=eol ? end1-eol-1 : 0;
+	}
+	if (suffix>0 && count_newlines(p1, rest1-suffix)==count_newlines(p2, rest2-suffix))
+	{
+		end1-=suffix;
+		end2-=suffix;
+	}
+
+	long dif=0; // number of different lines
+	struct kdiff_hunk hunk={NULL, {0}, 0};
+	size_t offset1=skipped, offset2=skipped; // where the lines start
+	for (long i=number+1;;++i)
+	{
+		const char *line1, *line2;
+		size_t len1, len2;
+		bool newline1, newline2;
+		bool more1=kdiff_next_line(&p1, end1, &line1, &len1, &newline1);
+		bool more2=kdiff_next_line(&p2, end2, &line2, &len2, &newline2);
+		if (!more1 && !more2)
+			break;
+		size_t start1=offset1, start2=offset2;
+		offset1+=more1 ? len1+newline1 : 0;
+		offset2+=more2 ? len2+newline2 : 0;
+		if (more1 && more2 && len1==len2 && newline1==newline2 && memcmp(line1, line2, len1)==0)
+		{
+			if (json)
+				kdiff_hunk_close(json, &hunk);
+			continue;
+		}
+		dif++;
+		if (!json)
+		{
+			kdiff_print_line(path1, i, more1 ? line1 : NULL, more1 ? len1 : 0);
+			kdiff_print_line(path2, i, more2 ? line2 : NULL, more2 ? len2 : 0);
+			continue;
+		}
+		if (!hunk.json)
+		{
+			hunk.json=json_record(json);
+			json_string(hunk.json, "type", "hunk", 4);
+			json_string(hunk.json, "old_file", path1, strlen(path1));
+			json_string(hunk.json, "new_file", path2, strlen(path2));
+			json_number(hunk.json, "line", i);
+			json_number(hunk.json, "old_offset", start1);
+			json_number(hunk.json, "new_offset", start2);
+			json_open(hunk.json, "old", '[');
+		}
+		//a line only one file has is left out of the other side
+		if (more1)
+			json_string(hunk.json, NULL, line1, len1);
+		if (more2)
+		{
+			struct json_out side={&hunk.new_lines, 1, {hunk.new_lines.len==0}};
+			json_string(&side, NULL, line2, len2);
+		}
+		hunk.count++;
+	}
+	if (json)
+		kdiff_hunk_close(json, &hunk);
+	free(hunk.new_lines.data);
+	fastutil_release(data1, size1, mapped1);
+	fastutil_release(data2, size2, mapped2);
+	return dif;
+}
+/**
+ * Writes a run of different bytes as a --json record
+ */
+void kdiff_range(struct json_writer *json, const char *path1, const char *path2, long offset, long length)
+{
+	struct json_out *out=json_record(json);
+	json_string(out, "type", "range", 5);
+	json_string(out, "old_file", path1, strlen(path1));
+	json_string(out, "new_file", path2, strlen(path2));
+	json_number(out, "offset", offset);
+	json_number(out, "length", length);
+	json_record_end(json);
+}
+/**
+ * Counts the positions at which two files hold different bytes, the tail of the longer file included
+ * @param  json writer for --json and --ndjson, where every run of different bytes becomes a range
+ *              record, NULL for text
+ * @return      number of different bytes, -1 if a file cannot be opened
+ */
+long kdiff_bytes(const char *path1, const char *path2, struct json_writer *json)
+{
+	struct reader file1, file2;
+	bool open1=reader_open(&file1, path1);
+	if (!open1 || !reader_open(&file2, path2))
+	{
+		printf("This file is not found: %s\n", open1 ? path2 : path1);
+		if (open1) reader_close(&file1);
+		return -1;
+	}
+	long dif=0, position=0, range=-1; // start of the open run of different bytes
+	while (1)
+	{
+		const char *block1, *block2;
+		size_t n1=reader_peek(&file1, &block1);
+		size_t n2=reader_peek(&file2, &block2);
+		if (n1==0 && n2==0)
+			break;
+		size_t common=n1<n2 ? n1 : n2;
+		if (common==0) // bytes only one file has
+		{
+			if (range==-1)
+				range=position;
+			dif+=n1+n2;
+			position+=n1+n2;
+			reader_skip(&file1, n1);
+			reader_skip(&file2, n2);
+			continue;
+		}
+		if (!json)
+			for (size_t i=0;i<common;++i)
+				dif+=block1[i]!=block2[i];
+		else
+			for (size_t i=0;i<common;++i)
+			{
+				bool different=block1[i]!=block2[i];
+				dif+=different;
+				if (different && range==-1)
+					range=position+i;
+				else if (!different && range!=-1)
+				{
+					kdiff_range(json, path1, path2, range, position+i-range);
+					range=-1;
+				}
+			}
+		position+=common;
+		reader_skip(&file1, common);
+		reader_skip(&file2, common);
+	}
+	if (json && range!=-1)
+		kdiff_range(json, path1, path2, range, position-range);
+	reader_close(&file1);
+	reader_close(&file2);
+	return dif;
+}
+enum kdiff_change {KDIFF_REMOVED, KDIFF_ADDED, KDIFF_CHANGED, KDIFF_UNREADABLE};
+struct kdiff_entry {
+	char *path; // relative to both roots, directories end with '/'
+	enum kdiff_change change;
+	bool files; // both sides are regular files, so they can be diffed
+};
+struct kdiff_tree {
+	const char *root1, *root2;
+	bool contents; // compare files with the same size and mtime too
+	pthread_mutex_t lock; // guards entries
+	struct kdiff_entry *entries;
+	int count, capacity;
+};
+struct kdiff_task {
+	struct kdiff_tree *tree;
+	char *path; // directory or file relative to the roots, "" for the roots themselves
+	off_t size; // file compared by contents
+};
+void kdiff_report(struct kdiff_tree *tree, const char *path, bool directory, enum kdiff_change change, bool files)
+{
+	char *copy=malloc(strlen(path)+2);
+	strcpy(copy, path);
+	if (directory)
+		strcat(copy, "/");
+	pthread_mutex_lock(&tree->lock);
+	if (tree->count==tree->capacity)
+	{
+		tree->capacity=tree->capacity ? tree->capacity*2 : 64;
+		tree->entries=realloc(tree->entries, sizeof(struct kdiff_entry)*tree->capacity);
+	}
+	tree->entries[tree->count++]=(struct kdiff_entry){copy, change, files};
+	pthread_mutex_unlock(&tree->lock);
+}
+void kdiff_join(char *buf, size_t size, const char *root, const char *path)
+{
+	snprintf(buf, size, *path ? "%s/%s" : "%s", root, path);
+}
+/**
+ * Compares two files of the same size block by block
+ * @return true if their contents are the same
+ */
+bool kdiff_same_contents(const char *path1, const char *path2, off_t size)
+{
+	struct reader file1, file2;
+	if (!reader_open(&file1, path1))
+		return false;
+	if (!reader_open(&file2, path2))
+	{
+		reader_close(&file1);
+		return false;
+	}
+	bool same=true;
+	for (off_t done=0;same && done<size;)
+	{
+		const char *block1, *block2;
+		size_t n1=reader_peek(&file1, &block1);
+		size_t n2=reader_peek(&file2, &block2);
+		size_t common=n1<n2 ? n1 : n2;
+		same=common>0 && memcmp(block1, block2, common)==0;
+		reader_skip(&file1, common);
+		reader_skip(&file2, common);
+		done+=common;
+	}
+	reader_close(&file1);
+	reader_close(&file2);
+	return same;
+}
+void kdiff_compare_task(void *arg)
+{
+	struct kdiff_task *task=arg;
+	char path1[4096], path2[4096];
+	kdiff_join(path1, sizeof(path1), task->tree->root1, task->path);
+	kdiff_join(path2, sizeof(path2), task->tree->root2, task->path);
+	if (!kdiff_same_contents(path1, path2, task->size))
+		kdiff_report(task->tree, task->path, false, KDIFF_CHANGED, true);
+	free(task->path);
+	free(task);
+}
+struct kdiff_name {
+	char *name;
+	struct stat st;
+};
+int kdiff_name_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct kdiff_name *)a)->name, ((const struct kdiff_name *)b)->name);
+}
+/**
+ * Lists a directory sorted by name, with lstat information for every entry
+ * @return number of entries, -1 if it cannot be read
+ */
+int kdiff_list(const char *path, struct kdiff_name **names)
+{
+	*names=NULL;
+	DIR *dir=opendir(path);
+	if (!dir)
+		return -1;
+	int count=0, capacity=0;
+	struct dirent *entry;
+	while ((entry=readdir(dir)))
+	{
+		if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0)
+			continue;
+		if (count==capacity)
+		{
+			capacity=capacity ? capacity*2 : 32;
+			*names=realloc(*names, sizeof(struct kdiff_name)*capacity);
+		}
+		struct kdiff_name *name=&(*names)[count];
+		if (fstatat(dirfd(dir), entry->d_name, &name->st, AT_SYMLINK_NOFOLLOW)==-1)
+			continue;
+		name->name=strdup(entry->d_name);
+		count++;
+	}
+	closedir(dir);
+	qsort(*names, count, sizeof(struct kdiff_name), kdiff_name_compare);
+	return count;
+}
+void kdiff_directory_task(void *arg);
+void kdiff_submit(struct kdiff_tree *tree, const char *path, off_t size, void (*run)(void *))
+{
+	struct kdiff_task *task=malloc(sizeof(struct kdiff_task));
+	task->tree=tree;
+	task->path=strdup(path);
+	task->size=size;
+	pool_submit(pool_get(), run, task);
+}
+/**
+ * Decides about a name found on both sides
+ */
+void kdiff_match(struct kdiff_tree *tree, const char *path, const struct stat *st1, const struct stat *st2)
+{
+	if ((st1->st_mode & S_IFMT)!=(st2->st_mode & S_IFMT))
+		kdiff_report(tree, path, false, KDIFF_CHANGED, false);
+	else if (S_ISDIR(st1->st_mode))
+		kdiff_submit(tree, path, 0, kdiff_directory_task);
+	else if (S_ISREG(st1->st_mode))
+	{
+		if (st1->st_size!=st2->st_size)
+			kdiff_report(tree, path, false, KDIFF_CHANGED, true);
+		else if (tree->contents || st1->st_mtim.tv_sec!=st2->st_mtim.tv_sec
+			|| st1->st_mtim.tv_nsec!=st2->st_mtim.tv_nsec)
+			kdiff_submit(tree, path, st1->st_size, kdiff_compare_task);
+	}
+	else if (S_ISLNK(st1->st_mode))
+	{
+		char path1[4096], path2[4096], target1[4096], target2[4096];
+		kdiff_join(path1, sizeof(path1), tree->root1, path);
+		kdiff_join(path2, sizeof(path2), tree->root2, path);
+		ssize_t len1=readlink(path1, target1, sizeof(target1));
+		ssize_t len2=readlink(path2, target2, sizeof(target2));
+		if (len1!=len2 || len1<0 || memcmp(target1, target2, len1)!=0)
+			kdiff_report(tree, path, false, KDIFF_CHANGED, false);
+	}
+}
+void kdiff_directory_task(void *arg)
+{
+	struct kdiff_task *task=arg;
+	struct kdiff_tree *tree=task->tree;
+	char path1[4096], path2[4096], child[4096];
+	kdiff_join(path1, sizeof(path1), tree->root1, task->path);
+	kdiff_join(path2, sizeof(path2), tree->root2, task->path);
+	struct kdiff_name *names1, *names2;
+	int count1=kdiff_list(path1, &names1);
+	int count2=kdiff_list(path2, &names2);
+	if (count1==-1 || count2==-1)
+		kdiff_report(tree, task->path, true, KDIFF_UNREADABLE, false);
+	else
+	{
+		//both listings are sorted, so they are merged in one pass
+		int i=0, j=0;
+		while (i<count1 || j<count2)
+		{
+			int order=i==count1 ? 1 : j==count2 ? -1 : strcmp(names1[i].name, names2[j].name);
+			const char *name=order<=0 ? names1[i].name : names2[j].name;
+			snprintf(child, sizeof(child), *task->path ? "%s/%s" : "%s%s", task->path, name);
+			if (order<0)
+				kdiff_report(tree, child, S_ISDIR(names1[i].st.st_mode), KDIFF_REMOVED, false);
+			else if (order>0)
+				kdiff_report(tree, child, S_ISDIR(names2[j].st.st_mode), KDIFF_ADDED, false);
+			else
+				kdiff_match(tree, child, &names1[i].st, &names2[j].st);
+			if (order<=0) i++;
+			if (order>=0) j++;
+		}
+	}
+	for (int k=0;k<count1;++k)
+		free(names1[k].name);
+	for (int k=0;k<count2;++k)
+		free(names2[k].name);
+	free(names1);
+	free(names2);
+	free(task->path);
+	free(task);
+}
+int kdiff_entry_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct kdiff_entry *)a)->path, ((const struct kdiff_entry *)b)->path);
+}
+/**
+ * Compares two directory trees and prints the added, removed and changed paths
+ * @param root1    old tree
+ * @param root2    new tree
+ * @param mode     0 to list only, 'a' to line diff and 'b' to byte diff every changed file
+ * @param contents compare files whose size and mtime match as well
+ * @param json     writer for --json and --ndjson, NULL for text
+ */
+void kdiff_tree(const char *root1, const char *root2, char mode, bool contents, struct json_writer *json)
+{
+	struct stat st1, st2;
+	if (stat(root1, &st1)==-1 || !S_ISDIR(st1.st_mode))
+	{
+		printf("This directory is not found: %s\n", root1);
+		return;
+	}
+	if (stat(root2, &st2)==-1 || !S_ISDIR(st2.st_mode))
+	{
+		printf("This directory is not found: %s\n", root2);
+		return;
+	}
+	struct kdiff_tree tree={root1, root2, contents, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+	struct thread_pool *pool=pool_get();
+	kdiff_submit(&tree, "", 0, kdiff_directory_task);
+	pool_wait(pool);
+	qsort(tree.entries, tree.count, sizeof(struct kdiff_entry), kdiff_entry_compare);
+	const char *labels[]={"removed", "added", "changed", "unreadable"};
+	int totals[4]={0};
+	for (int i=0;i<tree.count;++i)
+	{
+		struct kdiff_entry *entry=&tree.entries[i];
+		totals[entry->change]++;
+		if (json)
+		{
+			struct json_out *out=json_record(json);
+			json_string(out, "type", labels[entry->change], strlen(labels[entry->change]));
+			json_string(out, "path", entry->path, strlen(entry->path));
+			json_record_end(json);
+		}
+		else
+			printf("%s: %s\n", labels[entry->change], entry->path);
+		if (mode && entry->files)
+		{
+			char path1[4096], path2[4096];
+			kdiff_join(path1, sizeof(path1), root1, entry->path);
+			kdiff_join(path2, sizeof(path2), root2, entry->path);
+			if (mode=='a')
+				kdiff_lines(path1, path2, json);
+			else if (json)
+				kdiff_bytes(path1, path2, json);
+			else
+				printf("%s: different in %ld bytes\n", entry->path, kdiff_bytes(path1, path2, NULL));
+		}
+		free(entry->path);
+	}
+	free(tree.entries);
+	if (json)
+	{
+		struct json_out *out=json_record(json);
+		json_string(out, "type", "summary", 7);
+		json_number(out, "added", totals[KDIFF_ADDED]);
+		json_number(out, "removed", totals[KDIFF_REMOVED]);
+		json_number(out, "changed", totals[KDIFF_CHANGED]);
+		json_number(out, "unreadable", totals[KDIFF_UNREADABLE]);
+		json_record_end(json);
+	}
+	else if (tree.count==0)
+		printf("Trees are identical\n");
+	else
+		printf("%d added, %d removed, %d changed\n", totals[KDIFF_ADDED], totals[KDIFF_REMOVED],
+			totals[KDIFF_CHANGED]);
+}
+
+//event loop: one epoll instance owns terminal input, a signalfd for SIGCHLD, the scheduler timerfd,
+//the history inotify descriptor and the output pipes of background jobs. The prompt sleeps in it
+//between keys, so job output and notifications are printed above the line being edited and the
+//line is redrawn. SIGCHLD stays blocked in the shell and is unblocked again in every child.
+//The control socket and its connections are served from it as well.
+enum event_kind {EVENT_INPUT, EVENT_SIGNAL, EVENT_TIMER, EVENT_HISTORY, EVENT_JOB, EVENT_SERVE, EVENT_CLIENT};
+int event_fd=-1; // epoll instance
+int event_signal_fd=-1;
+bool event_input_pollable=true; // epoll refuses regular files, e.g. a script on stdin
+const char *event_line=NULL; // line being edited at the prompt, NULL while a command runs
+int event_line_length=0;
+/**
+ * Registers a descriptor for reading
+ * @param fd   descriptor
+ * @param kind what it is, decides the handler
+ * @param id   passed to the handler, the job id for EVENT_JOB and the client id for EVENT_CLIENT
+ */
+void event_add(int fd, enum event_kind kind, int id)
+{
+	if (event_fd==-1 || fd==-1)
+		return;
+	struct epoll_event event={.events=EPOLLIN, .data.u64=((uint64_t)kind<<32)|(uint32_t)id};
+	if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &event)==-1 && kind==EVENT_INPUT)
+		event_input_pollable=false;
+}
+/**
+ * Turns waiting for a registered descriptor to be writable on or off
+ */
+void event_watch_write(int fd, enum event_kind kind, int id, bool write)
+{
+	if (event_fd==-1)
+		return;
+	struct epoll_event event={.events=EPOLLIN|(write ? EPOLLOUT : 0), .data.u64=((uint64_t)kind<<32)|(uint32_t)id};
+	epoll_ctl(event_fd, EPOLL_CTL_MOD, fd, &event);
+}
+void event_remove(int fd)
+{
+	if (event_fd!=-1)
+		epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+void event_atfork_child()
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	event_fd=-1; // the child never waits in the loop, its copy of the descriptors is closed on exec
+}
+/**
+ * Prints text above the prompt, then redraws the prompt and the line being edited
+ */
+void event_print(const char *data, size_t len)
+{
+	if (event_line)
+		fputs("\r\033[K", stdout);
+	fwrite(data, 1, len, stdout);
+	if (event_line)
+	{
+		show_prompt();
+		fwrite(event_line, 1, event_line_length, stdout);
+	}
+	fflush(stdout);
+}
+
+//background jobs: every stage of a job writes stdout and stderr into one pipe that the event loop
+//drains. The output is printed above the prompt line by line, or kept with the job for
+//"jobs output" while the bgbuffer option is on.
+#define JOB_OUTPUT_MAX (1024*1024) // output kept per job, older output is dropped beyond this
+struct job {
+	int id;
+	char *command_line;
+	pid_t *pids; // one per stage, 0 once reaped
+	int pid_count, running;
+	int status; // wait status of the last stage
+	int output_fd; // -1 after EOF
+	bool announce; // print the start and completion lines, off for scheduled jobs
+	struct out_buf output; // kept output, or an unfinished line waiting to be printed
+	size_t dropped; // bytes dropped from the front of the kept output
+};
+struct job **jobs=NULL;
+int job_count=0, job_capacity=0;
+int last_status=0; // exit status of the last foreground command, 128+signal if it was killed
+struct job *job_find(int id)
+{
+	for (int i=0;i<job_count;++i)
+		if (jobs[i]->id==id)
+			return jobs[i];
+	return NULL;
+}
+void job_free(struct job *job)
+{
+	for (int i=0;i<job_count;++i)
+		if (jobs[i]==job)
+		{
+			memmove(jobs+i, jobs+i+1, sizeof(struct job *)*(job_count-i-1));
+			job_count--;
+			break;
+		}
+	free(job->command_line);
+	free(job->pids);
+	free(job->output.data);
+	free(job);
+}
+bool job_done(const struct job *job)
+{
+	return job->running==0 && job->output_fd==-1;
+}
+/**
+ * Describes how a job ended
+ */
+void job_state(const struct job *job, char *buf, size_t size)
+{
+	if (!job_done(job))
+		snprintf(buf, size, "Running");
+	else if (WIFSIGNALED(job->status))
+		snprintf(buf, size, "Killed (%s)", strsignal(WTERMSIG(job->status)));
+	else if (WEXITSTATUS(job->status)!=0)
+		snprintf(buf, size, "Exit %d", WEXITSTATUS(job->status));
+	else
+		snprintf(buf, size, "Done");
+}
+/**
+ * Announces a finished job and forgets it, unless it still holds output nobody has read
+ */
+void job_check_done(struct job *job)
+{
+	if (!job_done(job))
+		return;
+	if (job->announce)
+	{
+		char state[64], line[4096];
+		job_state(job, state, sizeof(state));
+		int len=snprintf(line, sizeof(line), "[%d]  %-12s %s%s\n", job->id, state, job->command_line,
+			job->output.len>0 ? " (output kept, see jobs output)" : "");
+		event_print(line, len<(int)sizeof(line) ? len : (int)sizeof(line)-1);
+	}
+	if (job->output.len==0)
+		job_free(job);
+}
+/**
+ * Reads what a job has written since the last call
+ */
+void job_read(int id)
+{
+	struct job *job=job_find(id);
+	if (!job || job->output_fd==-1)
+		return;
+	char buf[65536];
+	ssize_t n;
+	while ((n=read(job->output_fd, buf, sizeof(buf)))>0)
+	{
+		out_append(&job->output, buf, n);
+		if (shopt_enabled("bgbuffer"))
+		{
+			if (job->output.len>JOB_OUTPUT_MAX)
+			{
+				size_t drop=job->output.len-JOB_OUTPUT_MAX/2;
+				memmove(job->output.data, job->output.data+drop, job->output.len-drop);
+				job->output.len-=drop;
+				job->dropped+=drop;
+			}
+			continue;
+		}
+		//complete lines only, so a line is never split by a redraw
+		char *end=memrchr(job->output.data, '\n', job->output.len);
+		if (end)
+		{
+			size_t len=end-job->output.data+1;
+			event_print(job->output.data, len);
+			memmove(job->output.data, end+1, job->output.len-len);
+			job->output.len-=len;
+		}
+	}
+	if (n==-1 && (errno==EAGAIN || errno==EINTR))
+		return;
+	event_remove(job->output_fd);
+	close(job->output_fd);
+	job->output_fd=-1;
+	if (!shopt_enabled("bgbuffer") && job->output.len>0)
+	{
+		out_append(&job->output, "\n", 1);
+		event_print(job->output.data, job->output.len);
+		job->output.len=0;
+	}
+	job_check_done(job);
+}
+/**
+ * Reaps every finished child, recording the status of job stages
+ */
+void jobs_reap()
+{
+	int status;
+	pid_t pid;
+	while ((pid=waitpid(-1, &status, WNOHANG))>0)
+		for (int i=0;i<job_count;++i)
+		{
+			struct job *job=jobs[i];
+			int stage=0;
+			while (stage<job->pid_count && job->pids[stage]!=pid)
+				stage++;
+			if (stage==job->pid_count)
+				continue;
+			job->pids[stage]=0;
+			job->running--;
+			if (stage==job->pid_count-1)
+				job->status=status;
+			job_check_done(job);
+			break;
+		}
+}
+/**
+ * Builds the command line a job is listed with
+ */
+char *command_line_string(struct command_t *command)
+{
+	struct out_buf line={NULL, 0, 0};
+	for (struct command_t *stage=command;stage;stage=stage->next)
+	{
+		if (stage!=command)
+			out_puts(&line, " | ");
+		out_puts(&line, stage->name);
+		for (int i=0;i<stage->arg_count;++i)
+		{
+			out_puts(&line, " ");
+			out_puts(&line, stage->args[i]);
+		}
+	}
+	out_append(&line, "", 1);
+	return line.data;
+}
+pid_t *spawn_pipeline(struct command_t *command, int output_fd, int *count);
+/**
+ * Starts a pipeline as a background job whose output goes through the event loop
+ * @param  command  first stage
+ * @param  announce print the job id now and a line when it finishes
+ * @return          the job id, -1 on error
+ */
+int job_start(struct command_t *command, bool announce)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC)==-1)
+	{
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		return -1;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK); // the children keep a blocking write end
+	struct job *job=calloc(1, sizeof(struct job));
+	job->pids=spawn_pipeline(command, fds[1], &job->pid_count);
+	close(fds[1]);
+	job->running=job->pid_count;
+	job->output_fd=fds[0];
+	job->announce=announce;
+	job->command_line=command_line_string(command);
+	job->id=1; // lowest free id, like other shells
+	while (job_find(job->id))
+		job->id++;
+	if (job_count==job_capacity)
+	{
+		job_capacity=job_capacity ? job_capacity*2 : 8;
+		jobs=realloc(jobs, sizeof(struct job *)*job_capacity);
+	}
+	jobs[job_count++]=job;
+	event_add(job->output_fd, EVENT_JOB, job->id);
+	if (announce)
+		printf("[%d] %d\n", job->id, job->pid_count>0 ? (int)job->pids[job->pid_count-1] : -1);
+	return job->id;
+}
+/**
+ * Lists jobs, or prints and releases the output kept for one
+ * @param command jobs [output id]
+ */
+void jobs_run(struct command_t *command)
+{
+	if (command->arg_count==2 && strcmp(command->args[0], "output")==0)
+	{
+		struct job *job=job_find(atoi(command->args[1]));
+		if (!job)
+		{
+			printf("-%s: jobs: %s: no such job\n", sysname, command->args[1]);
+			return;
+		}
+		job_read(job->id);
+		if (job->dropped>0)
+			printf("[%zu earlier bytes dropped]\n", job->dropped);
+		fwrite(job->output.data, 1, job->output.len, stdout);
+		job->output.len=0;
+		job->dropped=0;
+		if (job_done(job))
+			job_free(job);
+		return;
+	}
+	if (command->arg_count>0)
+	{
+		printf("-%s: jobs: usage: jobs [output id]\n", sysname);
+		return;
+	}
+	for (int i=0;i<job_count;++i)
+	{
+		char state[64];
+		job_state(jobs[i], state, sizeof(state));
+		printf("[%d]  %-12s %s", jobs[i]->id, state, jobs[i]->command_line);
+		if (jobs[i]->output.len>0)
+			printf(" (%zu bytes of output)", jobs[i]->output.len);
+		printf("\n");
+	}
+}
+/**
+ * Creates the epoll instance and the SIGCHLD signalfd, called once at startup before any thread exists
+ */
+void event_init()
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	pthread_atfork(NULL, NULL, event_atfork_child);
+	event_fd=epoll_create1(EPOLL_CLOEXEC);
+	event_signal_fd=signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	event_add(STDIN_FILENO, EVENT_INPUT, 0);
+	event_add(event_signal_fd, EVENT_SIGNAL, 0);
+	event_add(history_watch_fd, EVENT_HISTORY, 0);
+}
+void sched_run_due();
+void serve_accept();
+void serve_read(int id);
+void serve_flush(int id);
+/**
+ * Waits for events and handles them
+ * @param  timeout milliseconds, -1 to block
+ * @return         true when terminal input is ready
+ */
+bool event_dispatch(int timeout)
+{
+	struct epoll_event events[32];
+	int n=epoll_wait(event_fd, events, 32, timeout);
+	if (n==-1)
+		return errno!=EINTR; // a broken loop must not keep the prompt from reading
+	bool input=false;
+	for (int i=0;i<n;++i)
+	{
+		int id=(uint32_t)events[i].data.u64;
+		switch (events[i].data.u64>>32)
+		{
+		case EVENT_INPUT:
+			input=true;
+			break;
+		case EVENT_SIGNAL:
+		{
+			struct signalfd_siginfo info[16];
+			while (read(event_signal_fd, info, sizeof(info))>0) ;
+			jobs_reap();
+			break;
+		}
+		case EVENT_TIMER:
+			sched_run_due();
+			break;
+		case EVENT_HISTORY:
+			history_poll();
+			break;
+		case EVENT_JOB:
+			job_read(id);
+			break;
+		case EVENT_SERVE:
+			serve_accept();
+			break;
+		case EVENT_CLIENT:
+			if (events[i].events&EPOLLOUT)
+				serve_flush(id);
+			if (events[i].events&~EPOLLOUT)
+				serve_read(id);
+			break;
+		}
+	}
+	return input;
+}
+/**
+ * Runs the event loop until a key can be read, called by the prompt before every key
+ * @param line   line being edited, redrawn after background output
+ * @param length its length
+ */
+void event_wait_input(const char *line, int length)
+{
+	fflush(stdout);
+	if (event_fd==-1)
+		return;
+	event_line=line;
+	event_line_length=length;
+	if (!event_input_pollable)
+		event_dispatch(0);
+	else
+		while (!event_dispatch(-1))
+			fflush(stdout);
+	event_line=NULL;
+}
+int process_command(struct command_t *command);
+//resource limits for commands started by the shell, from a "limit" prefix or the session defaults.
+//CPU time, address space and open files are rlimits set in the child before exec. A CPU share and
+//memory.max need a cgroup v2 leaf, which is created per command under the shell's own cgroup when
+//that cgroup delegates the cpu and memory controllers to its children, and removed when it ends.
+//Without one, -c is ignored and -m is enforced through the address space limit only.
+struct limits {
+	rlim_t cpu_seconds; // RLIMIT_CPU, 0 for none
+	rlim_t memory; // bytes, RLIMIT_AS and memory.max
+	rlim_t files; // RLIMIT_NOFILE
+	int cpu_percent; // cpu.max, in percent of one CPU
+};
+struct limits limit_defaults={0};
+const struct limits *limit_prefix=NULL; // limits of the "limit" command being run
+bool limit_verbose=false; // report usage for every command, on under the prefix
+struct limit_group {
+	char path[4096]; // empty without a cgroup
+	int procs_fd; // its cgroup.procs, written by the child to move itself in
+};
+bool limits_set(const struct limits *limits)
+{
+	return limits->cpu_seconds || limits->memory || limits->files || limits->cpu_percent;
+}
+const struct limits *limit_current()
+{
+	return limit_prefix ? limit_prefix : &limit_defaults;
+}
+/**
+ * Finds the cgroup v2 directory of the shell, once
+ * @return its path, NULL without a cgroup v2 hierarchy
+ */
+const char *limit_cgroup_base()
+{
+	static char base[4096];
+	static int state=-1; // -1 unknown, 0 unavailable, 1 found
+	if (state!=-1)
+		return state ? base : NULL;
+	state=0;
+	char mount[4096]="", line[4096], group[4096]="";
+	FILE *file=fopen("/proc/self/mountinfo", "r");
+	while (file && fgets(line, sizeof(line), file))
+	{
+		//the mount point is the fifth field, the filesystem type follows the " - " separator
+		char *separator=strstr(line, " - cgroup2 ");
+		char point[4096];
+		if (separator && sscanf(line, "%*s %*s %*s %*s %4095s", point)==1)
+			strcpy(mount, point);
+	}
+	if (file)
+		fclose(file);
+	file=fopen("/proc/self/cgroup", "r");
+	while (file && fgets(line, sizeof(line), file))
+		if (strncmp(line, "0::", 3)==0)
+		{
+			line[strcspn(line, "\n")]=0;
+			snprintf(group, sizeof(group), "%s", line+3);
+		}
+	if (file)
+		fclose(file);
+	if (mount[0]==0 || group[0]==0)
+		return NULL;
+	//a leaf name is appended to the base, so leave room for it
+	int len=snprintf(base, sizeof(base)-64, "%s%s", mount, strcmp(group, "/")==0 ? "" : group);
+	if (len<0 || len>=(int)sizeof(base)-64)
+		return NULL;
+	state=1;
+	return base;
+}
+bool limit_write(const char *dir, const char *name, const char *value)
+{
+	char path[4200];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd=open(path, O_WRONLY|O_CLOEXEC);
+	if (fd==-1)
+		return false;
+	bool ok=write(fd, value, strlen(value))==(ssize_t)strlen(value);
+	close(fd);
+	return ok;
+}
+/**
+ * Reads a number from a cgroup file, after the given key for flat keyed files
+ * @return the number, -1 if it cannot be read
+ */
+long long limit_read(const char *dir, const char *name, const char *key)
+{
+	char path[4200], data[4096];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd=open(path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+		return -1;
+	ssize_t n=read(fd, data, sizeof(data)-1);
+	close(fd);
+	if (n<=0)
+		return -1;
+	data[n]=0;
+	const char *p=data;
+	if (key)
+	{
+		size_t len=strlen(key);
+		while (p && !(strncmp(p, key, len)==0 && p[len]==' '))
+			p=(p=strchr(p, '\n')) ? p+1 : NULL;
+		if (!p)
+			return -1;
+		p+=len;
+	}
+	return strtoll(p, NULL, 10);
+}
+/**
+ * Creates the cgroup leaf a command runs in, when its limits need one
+ */
+void limit_group_open(struct limit_group *group, const struct limits *limits)
+{
+	static int serial=0;
+	static bool warned=false;
+	group->path[0]=0;
+	group->procs_fd=-1;
+	if (!limits->memory && !limits->cpu_percent)
+		return;
+	const char *base=limit_cgroup_base();
+	if (base)
+	{
+		int len=snprintf(group->path, sizeof(group->path), "%s/seashell-%d-%d", base, (int)getpid(), ++serial);
+		if (len<0 || len>=(int)sizeof(group->path) || mkdir(group->path, 0755)==-1)
+			group->path[0]=0;
+	}
+	bool ok=group->path[0]!=0;
+	char value[64];
+	if (ok && limits->memory)
+	{
+		snprintf(value, sizeof(value), "%llu", (unsigned long long)limits->memory);
+		ok=limit_write(group->path, "memory.max", value);
+		limit_write(group->path, "memory.swap.max", "0"); // a swapping command would only get slower
+	}
+	if (ok && limits->cpu_percent)
+	{
+		snprintf(value, sizeof(value), "%d 100000", limits->cpu_percent*1000);
+		ok=limit_write(group->path, "cpu.max", value);
+	}
+	if (ok)
+	{
+		char path[4200];
+		snprintf(path, sizeof(path), "%s/cgroup.procs", group->path);
+		group->procs_fd=open(path, O_WRONLY|O_CLOEXEC);
+		ok=group->procs_fd!=-1;
+	}
+	if (ok)
+		return;
+	if (group->path[0])
+		rmdir(group->path);
+	group->path[0]=0;
+	if (!warned)
+		printf("-%s: limit: no cgroup with the cpu and memory controllers, %s\n", sysname,
+			limits->cpu_percent ? "the cpu share is not applied" : "memory is limited by address space only");
+	warned=true;
+}
+/**
+ * Removes a command's cgroup leaf, killing whatever it left running there
+ */
+void limit_group_close(struct limit_group *group)
+{
+	if (group->procs_fd!=-1)
+		close(group->procs_fd);
+	if (group->path[0] && rmdir(group->path)==-1 && errno==EBUSY)
+	{
+		limit_write(group->path, "cgroup.kill", "1");
+		for (int i=0;i<100 && rmdir(group->path)==-1 && errno==EBUSY;++i)
+			usleep(1000);
+	}
+	group->path[0]=0;
+	group->procs_fd=-1;
+}
+/**
+ * Lowers one rlimit of the calling process, reporting on stderr when it cannot
+ * @param name option it came from, for the report
+ */
+void limit_rlimit(int resource, rlim_t value, const char *name)
+{
+	struct rlimit limit;
+	if (value==0 || getrlimit(resource, &limit)==-1)
+		return;
+	//only ever lowered, an unprivileged child could not raise the hard limit back anyway
+	rlim_t hard=limit.rlim_max;
+	if (hard!=RLIM_INFINITY && hard<value)
+		value=hard;
+	limit.rlim_cur=value;
+	limit.rlim_max=value;
+	if (resource==RLIMIT_CPU && (hard==RLIM_INFINITY || value<hard))
+		limit.rlim_max=value+1; // SIGXCPU first, SIGKILL a second later
+	if (setrlimit(resource, &limit)==-1)
+		fprintf(stderr, "-%s: limit: %s: %s\n", sysname, name, strerror(errno));
+}
+/**
+ * Applies limits to the calling process, in the child between fork and exec
+ */
+void limit_apply(const struct limits *limits, const struct limit_group *group)
+{
+	if (group && group->procs_fd!=-1)
+		write(group->procs_fd, "0", 1); // 0 moves the writer
+	limit_rlimit(RLIMIT_CPU, limits->cpu_seconds, "-t");
+	limit_rlimit(RLIMIT_AS, limits->memory, "-m");
+	limit_rlimit(RLIMIT_NOFILE, limits->files, "-n");
+}
+/**
+ * Prints how much a limited command used and whether a limit ended it
+ */
+void limit_report(const char *name, const struct limit_group *group, int status, const struct rusage *usage)
+{
+	long long oom=group->path[0] ? limit_read(group->path, "memory.events", "oom_kill") : -1;
+	const char *reason=NULL;
+	if (WIFSIGNALED(status) && WTERMSIG(status)==SIGXCPU)
+		reason="cpu time limit";
+	else if (WIFSIGNALED(status) && WTERMSIG(status)==SIGKILL && oom>0)
+		reason="memory limit";
+	if (!limit_verbose && !reason)
+		return;
+	char state[64];
+	if (WIFSIGNALED(status))
+		snprintf(state, sizeof(state), "killed (%s)", reason ? reason : strsignal(WTERMSIG(status)));
+	else
+		snprintf(state, sizeof(state), "exit %d", WEXITSTATUS(status));
+	long long peak=group->path[0] ? limit_read(group->path, "memory.peak", NULL) : -1;
+	printf("%s: %s, user %.2fs, sys %.2fs, max rss %ldK", name, state,
+		usage->ru_utime.tv_sec+usage->ru_utime.tv_usec/1e6, usage->ru_stime.tv_sec+usage->ru_stime.tv_usec/1e6,
+		usage->ru_maxrss);
+	if (peak>=0)
+		printf(", cgroup peak %lldK", peak/1024);
+	printf("\n");
+}
+/**
+ * Runs an external command with the current limits and waits for it
+ * @return SUCCESS, the exit status is left in last_status
+ */
+int limit_run(struct command_t *command)
+{
+	const struct limits *limits=limit_current();
+	struct limit_group group;
+	limit_group_open(&group, limits);
+	fflush(stdout);
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		limit_apply(limits, &group);
+		exec_command(command);
+	}
+	int status;
+	struct rusage usage;
+	if (pid==-1)
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	else if (wait4(pid, &status, 0, &usage)==pid)
+	{
+		last_status=WIFSIGNALED(status) ? 128+WTERMSIG(status) : WEXITSTATUS(status);
+		limit_report(command->name, &group, status, &usage);
+	}
+	limit_group_close(&group);
+	return SUCCESS;
+}
+/**
+ * Parses limit options. Values are plain decimal numbers, -m takes an optional K, M, G or T
+ * suffix and -c a percent of one CPU, up to 100 per online CPU.
+ * @param  used set to the number of arguments taken
+ * @return      false on a malformed option or an out of range value
+ */
+bool limit_parse(struct command_t *command, struct limits *limits, int *used)
+{
+	int i=0;
+	for (;i<command->arg_count && command->args[i][0]=='-';i+=2)
+	{
+		const char *option=command->args[i];
+		if (i+1>=command->arg_count || strlen(option)!=2 || !strchr("tmnc", option[1]))
+			return false;
+		const char *text=command->args[i+1];
+		char *end;
+		errno=0;
+		unsigned long long value=strtoull(text, &end, 10);
+		if (!isdigit((unsigned char)text[0]) || errno==ERANGE || (*end && (option[1]!='m' || end[1])))
+			return false;
+		switch (option[1])
+		{
+		case 't':
+			limits->cpu_seconds=value;
+			break;
+		case 'm':
+		{
+			//sizes take a K, M, G or T suffix
+			const char *units="KMGT", *unit=*end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+			if (*end && !unit)
+				return false;
+			for (int k=unit ? unit-units+1 : 0;k>0;--k)
+			{
+				if (value>ULLONG_MAX/1024)
+					return false;
+				value*=1024;
+			}
+			limits->memory=value;
+			break;
+		}
+		case 'n':
+			limits->files=value;
+			break;
+		case 'c':
+		{
+			long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+			if (value==0 || value>100ULL*(cpus>0 ? cpus : 1))
+				return false;
+			limits->cpu_percent=value;
+			break;
+		}
+		}
+	}
+	*used=i;
+	return true;
+}
+void limit_print(const struct limits *limits)
+{
+	if (!limits_set(limits))
+	{
+		printf("no limits\n");
+		return;
+	}
+	if (limits->cpu_seconds)
+		printf("cpu time   %llus\n", (unsigned long long)limits->cpu_seconds);
+	if (limits->memory)
+		printf("memory     %lluK\n", (unsigned long long)limits->memory/1024);
+	if (limits->files)
+		printf("open files %llu\n", (unsigned long long)limits->files);
+	if (limits->cpu_percent)
+		printf("cpu share  %d%%\n", limits->cpu_percent);
+}
+/**
+ * Shows or sets the session defaults, or runs a command with limits
+ * @param  command limit | limit default [options] | limit default off | limit [options] command [args]
+ *                 with the options -t cpu_seconds -m size -n open_files -c cpu_percent
+ * @return         the code of the command that was run
+ */
+int limit_run_builtin(struct command_t *command)
+{
+	const char *usage="-%s: limit: usage: limit [default] [-t seconds] [-m size[K|M|G|T]] [-n files] [-c percent] [command]\n";
+	if (command->arg_count==0)
+	{
+		limit_print(&limit_defaults);
+		return SUCCESS;
+	}
+	bool defaults=strcmp(command->args[0], "default")==0;
+	if (defaults && command->arg_count==2 && strcmp(command->args[1], "off")==0)
+	{
+		memset(&limit_defaults, 0, sizeof(limit_defaults));
+		return SUCCESS;
+	}
+	struct limits limits=limit_defaults; // options override the defaults one by one
+	int used;
+	if (defaults)
+	{
+		command->arg_count--; // parsed from the second argument, put back below
+		command->args++;
+	}
+	bool ok=limit_parse(command, &limits, &used);
+	if (defaults)
+	{
+		command->arg_count++;
+		command->args--;
+	}
+	if (!ok || (defaults && used+1!=command->arg_count) || (!defaults && used==command->arg_count))
+	{
+		printf(usage, sysname);
+		return SUCCESS;
+	}
+	if (defaults)
+	{
+		limit_defaults=limits;
+		limit_print(&limit_defaults);
+		return SUCCESS;
+	}
+	//the rest is the command, moved to the front the way json_flag drops its flags
+	free(command->name);
+	for (int i=0;i<used;++i)
+		free(command->args[i]);
+	command->name=command->args[used];
+	command->arg_count-=used+1;
+	memmove(command->args, command->args+used+1, sizeof(char *)*command->arg_count);
+	if (command->quotes)
+		memmove(command->quotes, command->quotes+used+1, command->arg_count);
+	const struct limits *outer=limit_prefix;
+	bool outer_verbose=limit_verbose;
+	limit_prefix=&limits;
+	limit_verbose=true;
+	int code=process_command(command);
+	limit_prefix=outer;
+	limit_verbose=outer_verbose;
+	return code;
+}
+const char *builtin_names[] = {"hist", "shopt", "cd", "exit", "shortdir", "goodMorning", "kdiff", "highlight",
+	"at", "every", "sched", "memo", "jobs", "serve", "limit", NULL};
+bool is_builtin(const char *name)
+{
+	for (int i=0;builtin_names[i];++i)
+		if (strcmp(builtin_names[i], name)==0)
+			return true;
+	return false;
+}
+int process_command(struct command_t *command);
+/**
+ * Runs a command in an already forked child, builtins through process_command, never returns
+ */
+void run_stage(struct command_t *command)
+{
+	if (shopt_enabled("fastutils") && fastutil_run(command))
+	{
+		fflush(stdout);
+		_exit(0);
+	}
+	if (is_builtin(command->name))
+	{
+		last_status=0; // set by a command a builtin runs, e.g. limit
+		int code=process_command(command);
+		fflush(stdout);
+		_exit(code==SUCCESS ? last_status : 1);
+	}
+	if (limits_set(limit_current()))
+	{
+		//waits here so the cgroup can be removed and the usage reported when it ends
+		limit_run(command);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	exec_command(command);
+}
+/**
+ * Forks every stage of a pipeline, each connected to the next one by a pipe.
+ * Builtins run through process_command in their child, so they work as filters too.
+ * @param  command   first stage
+ * @param  output_fd where the last stage writes and every stage reports errors, -1 for the terminal;
+ *                   stages then read from /dev/null so they never take terminal input
+ * @param  count     set to the number of children started
+ * @return           their pids, in stage order
+ */
+pid_t *spawn_pipeline(struct command_t *command, int output_fd, int *count)
+{
+	int in_fd=-1, stage_count=0;
+	for (struct command_t *stage=command;stage;stage=stage->next)
+		stage_count++;
+	pid_t *pids=malloc(sizeof(pid_t)*stage_count);
+	int n=0;
+	for (struct command_t *stage=command;stage;stage=stage->next)
+	{
+		int fds[2]={-1, -1};
+		if (stage->next && pipe2(fds, O_CLOEXEC)==-1)
+		{
+			printf("-%s: %s: %s\n", sysname, stage->name, strerror(errno));
+			break;
+		}
+		fflush(stdout);
+		pid_t pid=fork();
+		if (pid==0)
+		{
+			if (output_fd!=-1)
+			{
+				int null_fd=open("/dev/null", O_RDONLY);
+				dup2(null_fd, STDIN_FILENO);
+				close(null_fd);
+				if (!stage->next)
+					dup2(output_fd, STDOUT_FILENO);
+				dup2(output_fd, STDERR_FILENO);
+			}
+			if (in_fd!=-1)
+				dup2(in_fd, STDIN_FILENO);
+			if (fds[1]!=-1)
+				dup2(fds[1], STDOUT_FILENO);
+			stage->next=NULL;
+			stage->background=false; // already in the background, process_command must not start a job again
+			run_stage(stage);
+		}
+		if (in_fd!=-1)
+			close(in_fd);
+		if (fds[1]!=-1)
+			close(fds[1]);
+		in_fd=fds[0];
+		if (pid>0)
+			pids[n++]=pid;
+	}
+	if (in_fd!=-1)
+		close(in_fd);
+	*count=n;
+	return pids;
+}
+/**
+ * Runs a pipeline, waiting for it unless it is a background job
+ * @param  command first stage
+ * @return         SUCCESS
+ */
+int run_pipeline(struct command_t *command)
+{
+	if (command->background)
+	{
+		job_start(command, true);
+		return SUCCESS;
+	}
+	int n, status=0;
+	pid_t *pids=spawn_pipeline(command, -1, &n);
+	for (int i=0;i<n;++i)
+		waitpid(pids[i], &status, 0);
+	free(pids);
+	//the status of a pipeline is that of its last stage
+	last_status=WIFSIGNALED(status) ? 128+WTERMSIG(status) : WEXITSTATUS(status);
+	return SUCCESS;
+}
+
+//expansion between parsing and execution: $NAME, ${NAME}, $$, $?, $(command) and globs. Words without
+//anything to expand keep their allocation and are moved as they are. Unquoted results are split at
+//blanks and globbed, double quoted words are expanded but neither split nor globbed, single quoted
+//words are left alone. In unquoted words a backslash quotes a following glob character or backslash,
+//which is then matched literally and loses the backslash, any other backslash is kept as it is.
+//Globs read directory listings through a cache keyed by path that is only refreshed when the
+//directory's mtime or inode changes, so globbing a large unchanged directory does not re-scan it.
+//Every pattern component is compiled once and matched against the cached names.
+struct word_list {
+	char **words;
+	int count, capacity;
+};
+void word_list_add(struct word_list *list, char *word)
+{
+	if (list->count==list->capacity)
+	{
+		list->capacity=list->capacity ? list->capacity*2 : 8;
+		list->words=realloc(list->words, sizeof(char *)*list->capacity);
+	}
+	list->words[list->count++]=word;
+}
+struct glob_name {
+	const char *name;
+	unsigned char type; // d_type
+};
+struct glob_dir {
+	char *path;
+	struct timespec mtime;
+	ino_t inode;
+	char *data; // the names, null separated
+	struct glob_name *names; // sorted
+	int count;
+	struct glob_dir *next; // same hash bucket
+};
+#define GLOB_CACHE_BUCKETS 256
+#define GLOB_CACHE_MAX 1024 // cached directories, the cache starts over past this
+struct glob_dir *glob_cache[GLOB_CACHE_BUCKETS];
+int glob_cache_count=0;
+void glob_dir_release(struct glob_dir *dir)
+{
+	free(dir->data);
+	free(dir->names);
+	dir->data=NULL;
+	dir->names=NULL;
+	dir->count=0;
+}
+void glob_cache_clear()
+{
+	for (int i=0;i<GLOB_CACHE_BUCKETS;++i)
+		while (glob_cache[i])
+		{
+			struct glob_dir *dir=glob_cache[i];
+			glob_cache[i]=dir->next;
+			glob_dir_release(dir);
+			free(dir->path);
+			free(dir);
+		}
+	glob_cache_count=0;
+}
+int glob_name_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct glob_name *)a)->name, ((const struct glob_name *)b)->name);
+}
+/**
+ * Returns the sorted listing of a directory, from the cache while the directory is unchanged
+ * @param  path directory, "" for the current one
+ * @return      NULL if it is not a readable directory
+ */
+const struct glob_dir *glob_list(const char *path)
+{
+	const char *open_path=*path ? path : ".";
+	struct stat st;
+	if (stat(open_path, &st)==-1 || !S_ISDIR(st.st_mode))
+		return NULL;
+	if (glob_cache_count>=GLOB_CACHE_MAX)
+		glob_cache_clear();
+	struct glob_dir **bucket=&glob_cache[fnv1a(path, strlen(path))%GLOB_CACHE_BUCKETS], *dir;
+	for (dir=*bucket;dir;dir=dir->next)
+		if (strcmp(dir->path, path)==0)
+			break;
+	if (dir && dir->inode==st.st_ino && dir->mtime.tv_sec==st.st_mtim.tv_sec
+		&& dir->mtime.tv_nsec==st.st_mtim.tv_nsec)
+		return dir;
+	if (!dir)
+	{
+		dir=calloc(1, sizeof(struct glob_dir));
+		dir->path=strdup(path);
+		dir->next=*bucket;
+		*bucket=dir;
+		glob_cache_count++;
+	}
+	glob_dir_release(dir);
+	//stat comes before the listing, so a change made while reading shows up as a new mtime next time
+	dir->mtime=st.st_mtim;
+	dir->inode=st.st_ino;
+	DIR *d=opendir(open_path);
+	if (!d)
+	{
+		dir->inode=0; // not cached
+		return NULL;
+	}
+	struct out_buf data={0};
+	struct out_buf types={0};
+	struct dirent *entry;
+	while ((entry=readdir(d)))
+	{
+		out_append(&data, entry->d_name, strlen(entry->d_name)+1);
+		out_append(&types, (char *)&entry->d_type, 1);
+		dir->count++;
+	}
+	closedir(d);
+	dir->data=data.data;
+	dir->names=malloc(sizeof(struct glob_name)*(dir->count ? dir->count : 1));
+	const char *name=data.data;
+	for (int i=0;i<dir->count;++i)
+	{
+		dir->names[i]=(struct glob_name){name, (unsigned char)types.data[i]};
+		name+=strlen(name)+1;
+	}
+	free(types.data);
+	qsort(dir->names, dir->count, sizeof(struct glob_name), glob_name_compare);
+	return dir;
+}
+/**
+ * Whether s[i] is a backslash quoting a glob character or another backslash
+ */
+static inline bool glob_escape(const char *s, size_t i, size_t len)
+{
+	return s[i]=='\\' && i+1<len && s[i+1] && strchr("*?[]\\", s[i+1]);
+}
+/**
+ * Removes the backslashes of glob escapes in place, once a word is done with glob matching
+ */
+char *glob_unescape(char *word)
+{
+	size_t len=strlen(word), n=0;
+	for (size_t i=0;i<len;++i)
+	{
+		if (glob_escape(word, i, len))
+			i++;
+		word[n++]=word[i];
+	}
+	word[n]=0;
+	return word;
+}
+enum glob_op {GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS};
+struct glob_token {
+	enum glob_op op;
+	unsigned char c; // GLOB_LITERAL
+	uint8_t class[32]; // GLOB_CLASS, one bit per byte
+};
+/**
+ * Compiles one pattern component: * ? [...] [!...] with ranges, and \ to quote a glob character
+ * @return number of tokens, tokens holds room for len
+ */
+int glob_compile(const char *pattern, size_t len, struct glob_token *tokens)
+{
+	int count=0;
+	for (size_t i=0;i<len;++i)
+	{
+		struct glob_token *token=&tokens[count++];
+		token->op=GLOB_LITERAL;
+		token->c=pattern[i];
+		if (pattern[i]=='*')
+		{
+			token->op=GLOB_STAR;
+			if (count>1 && tokens[count-2].op==GLOB_STAR) // ** is *
+				count--;
+		}
+		else if (pattern[i]=='?')
+			token->op=GLOB_ANY;
+		else if (glob_escape(pattern, i, len))
+			token->c=pattern[++i];
+		else if (pattern[i]=='[')
+		{
+			size_t j=i+1;
+			bool negate=j<len && (pattern[j]=='!' || pattern[j]=='^');
+			if (negate) j++;
+			size_t first=j;
+			while (j<len && (pattern[j]!=']' || j==first))
+				j++;
+			if (j>=len) // no closing bracket, a literal [
+				continue;
+			memset(token->class, 0, sizeof(token->class));
+			for (size_t k=first;k<j;++k)
+			{
+				unsigned char from=pattern[k], to=from;
+				if (k+2<j && pattern[k+1]=='-')
+				{
+					to=pattern[k+2];
+					k+=2;
+				}
+				for (int c=from;c<=to;++c)
+					token->class[c>>3]|=1<<(c&7);
+			}
+			if (negate)
+				for (int k=0;k<32;++k)
+					token->class[k]=~token->class[k];
+			token->op=GLOB_CLASS;
+			i=j;
+		}
+	}
+	return count;
+}
+bool glob_match(const struct glob_token *tokens, int count, const char *name)
+{
+	int t=0, star=-1;
+	const char *s=name, *star_s=NULL;
+	while (*s)
+	{
+		if (t<count && tokens[t].op==GLOB_STAR)
+		{
+			star=t++;
+			star_s=s;
+			continue;
+		}
+		unsigned char c=*s;
+		if (t<count && (tokens[t].op==GLOB_ANY || (tokens[t].op==GLOB_LITERAL && tokens[t].c==c)
+			|| (tokens[t].op==GLOB_CLASS && (tokens[t].class[c>>3] & (1<<(c&7))))))
+		{
+			t++;
+			s++;
+			continue;
+		}
+		if (star==-1)
+			return false;
+		t=star+1; // the last * takes one more character
+		s=++star_s;
+	}
+	while (t<count && tokens[t].op==GLOB_STAR)
+		t++;
+	return t==count;
+}
+/**
+ * Whether a pattern component has unquoted glob characters
+ */
+bool glob_magic(const char *s, size_t len)
+{
+	for (size_t i=0;i<len;++i)
+	{
+		if (glob_escape(s, i, len))
+			i++;
+		else if (s[i]=='*' || s[i]=='?' || (s[i]=='[' && memchr(s+i, ']', len-i)))
+			return true;
+	}
+	return false;
+}
+/**
+ * Matches the remaining pattern components below path, adding every match to list
+ * @param path prefix matched so far, ending with '/' unless empty, with room to grow
+ * @return     number of matches added
+ */
+int glob_walk(char *path, size_t path_len, const char *rest, struct word_list *list)
+{
+	size_t len=strcspn(rest, "/");
+	const char *next=rest+len;
+	bool directory=*next=='/'; // another component or a trailing slash follows
+	while (*next=='/')
+		next++;
+	int found=0;
+	if (!glob_magic(rest, len))
+	{
+		//a plain component is taken as it is, without its backslashes
+		size_t n=path_len;
+		for (size_t i=0;i<len && n<PATH_MAX-2;++i)
+			path[n++]=glob_escape(rest, i, len) ? rest[++i] : rest[i];
+		if (directory)
+			path[n++]='/';
+		path[n]=0;
+		struct stat st;
+		if (*next)
+			return glob_walk(path, n, next, list);
+		if (lstat(path, &st)==0)
+		{
+			word_list_add(list, strdup(path));
+			return 1;
+		}
+		return 0;
+	}
+	path[path_len]=0;
+	const struct glob_dir *dir=glob_list(path);
+	if (!dir)
+		return 0;
+	struct glob_token *tokens=malloc(sizeof(struct glob_token)*(len+1));
+	int count=glob_compile(rest, len, tokens);
+	bool dot=rest[0]=='.'; // hidden names match only a pattern starting with a dot
+	for (int i=0;i<dir->count;++i)
+	{
+		const char *name=dir->names[i].name;
+		if ((name[0]=='.' && !dot) || strcmp(name, ".")==0 || strcmp(name, "..")==0)
+			continue;
+		if (!glob_match(tokens, count, name))
+			continue;
+		size_t n=path_len+strlen(name);
+		if (n>=PATH_MAX-2)
+			continue;
+		strcpy(path+path_len, name);
+		if (directory)
+		{
+			unsigned char type=dir->names[i].type;
+			struct stat st;
+			bool is_directory=type==DT_DIR;
+			if (type==DT_LNK || type==DT_UNKNOWN)
+				is_directory=stat(path, &st)==0 && S_ISDIR(st.st_mode);
+			if (!is_directory)
+				continue;
+			path[n++]='/';
+			path[n]=0;
+		}
+		if (*next)
+			found+=glob_walk(path, n, next, list);
+		else
+		{
+			word_list_add(list, strdup(path));
+			found++;
+		}
+	}
+	free(tokens);
+	return found;
+}
+/**
+ * Adds the paths a pattern matches in sorted order, or the pattern itself when nothing matches
+ */
+void glob_expand(char *pattern, struct word_list *list)
+{
+	char path[PATH_MAX];
+	size_t path_len=0;
+	const char *rest=pattern;
+	if (*rest=='/')
+	{
+		path[path_len++]='/';
+		while (*rest=='/')
+			rest++;
+	}
+	if (glob_walk(path, path_len, rest, list)>0)
+		free(pattern);
+	else
+		word_list_add(list, glob_unescape(pattern));
+}
+void expand_command(struct command_t *command);
+/**
+ * Runs a command line in a child and returns its output through a pipe, without trailing newlines
+ */
+void expand_substitute(const char *text, size_t len, struct out_buf *out)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC)==-1)
+		return;
+	fflush(stdout);
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		char *line=strndup(text, len);
+		struct command_t *command=calloc(1, sizeof(struct command_t));
+		parse_command(line, command);
+		expand_command(command);
+		command->background=false;
+		if (command->next)
+			_exit(run_pipeline(command)==SUCCESS ? 0 : 1);
+		if (command->name[0]==0)
+			_exit(0);
+		run_stage(command);
+	}
+	close(fds[1]);
+	size_t start=out->len;
+	char buf[65536];
+	ssize_t n;
+	while (pid>0 && ((n=read(fds[0], buf, sizeof(buf)))>0 || (n==-1 && errno==EINTR)))
+		if (n>0)
+			out_append(out, buf, n);
+	close(fds[0]);
+	if (pid>0)
+		waitpid(pid, NULL, 0);
+	while (out->len>start && out->data[out->len-1]=='\n')
+		out->len--;
+}
+/**
+ * Ends the field being built and adds it, globbed unless it came from a quoted word
+ */
+void expand_field(struct out_buf *field, char quote, struct word_list *list)
+{
+	out_append(field, "", 1);
+	char *word=strdup(field->data);
+	field->len=0;
+	if (!quote && glob_magic(word, strlen(word)))
+		glob_expand(word, list);
+	else
+		word_list_add(list, quote ? word : glob_unescape(word));
+}
+/**
+ * Expands one word into list, taking ownership of it
+ * @param quote quote that wrapped the word, 0 if none
+ */
+void expand_word(char *word, char quote, struct word_list *list)
+{
+	if (quote=='\'' || !strpbrk(word, quote ? "$" : "$*?[\\"))
+	{
+		word_list_add(list, word); // nothing to expand, the word is moved as it is
+		return;
+	}
+	struct out_buf field={0};
+	bool have_field=quote!=0; // a quoted word stays a word even if it expands to nothing
+	for (const char *p=word;*p;)
+	{
+		if (*p!='$')
+		{
+			out_append(&field, p++, 1);
+			have_field=true;
+			continue;
+		}
+		struct out_buf value={0};
+		const char *start=p+1;
+		if (*start=='(')
+		{
+			const char *end=start+1;
+			for (struct word_state state={0, 1};*end;++end)
+			{
+				word_scan(end, 1, &state);
+				if (state.depth==0)
+					break;
+			}
+			expand_substitute(start+1, end-start-1, &value);
+			p=*end ? end+1 : end;
+		}
+		else if (*start=='{' && strchr(start, '}'))
+		{
+			const char *end=strchr(start, '}');
+			char *name=strndup(start+1, end-start-1);
+			const char *env=getenv(name);
+			if (env)
+				out_puts(&value, env);
+			free(name);
+			p=end+1;
+		}
+		else if (isalpha((unsigned char)*start) || *start=='_')
+		{
+			const char *end=start;
+			while (isalnum((unsigned char)*end) || *end=='_')
+				end++;
+			char *name=strndup(start, end-start);
+			const char *env=getenv(name);
+			if (env)
+				out_puts(&value, env);
+			free(name);
+			p=end;
+		}
+		else if (*start=='$' || *start=='?')
+		{
+			char number[32];
+			snprintf(number, sizeof(number), "%d", *start=='$' ? (int)getpid() : last_status);
+			out_puts(&value, number);
+			p=start+1;
+		}
+		else
+		{
+			out_append(&field, p++, 1); // a lone $
+			have_field=true;
+			continue;
+		}
+		for (size_t i=0;i<value.len;++i)
+		{
+			//unquoted results are split into fields at blanks
+			if (!quote && (value.data[i]==' ' || value.data[i]=='\t' || value.data[i]=='\n'))
+			{
+				if (have_field)
+					expand_field(&field, quote, list);
+				have_field=false;
+				continue;
+			}
+			out_append(&field, value.data+i, 1);
+			have_field=true;
+		}
+		free(value.data);
+	}
+	if (have_field)
+		expand_field(&field, quote, list);
+	free(field.data);
+	free(word);
+}
+/**
+ * Expands the name and arguments of every stage of a command in place
+ */
+void expand_command(struct command_t *command)
+{
+	for (struct command_t *stage=command;stage;stage=stage->next)
+	{
+		bool needed=strpbrk(stage->name, "$*?[\\")!=NULL;
+		for (int i=0;!needed && i<stage->arg_count;++i)
+			needed=stage->quotes[i]!='\'' && strpbrk(stage->args[i], stage->quotes[i] ? "$" : "$*?[\\")!=NULL;
+		if (!needed)
+			continue;
+		struct word_list list={0};
+		expand_word(stage->name, 0, &list);
+		for (int i=0;i<stage->arg_count;++i)
+			expand_word(stage->args[i], stage->quotes[i], &list);
+		free(stage->args);
+		free(stage->quotes);
+		//the first word is the command, it is gone when it expanded to nothing
+		stage->name=list.count>0 ? list.words[0] : strdup("");
+		stage->arg_count=list.count>0 ? list.count-1 : 0;
+		stage->args=malloc(sizeof(char *)*(stage->arg_count ? stage->arg_count : 1));
+		stage->quotes=calloc(stage->arg_count ? stage->arg_count : 1, 1);
+		for (int i=0;i<stage->arg_count;++i)
+		{
+			stage->args[i]=list.words[i+1];
+			stage->quotes[i]='\''; // already expanded
+		}
+		free(list.words);
+	}
+}
+
+//control socket: "serve PATH" listens on a Unix socket so programs can drive this shell instead of
+//starting new ones. A request is a command line preceded by its length as a 4-byte big-endian
+//number. Each one runs through process_command like a typed line, with stdin on /dev/null and
+//stdout and stderr captured in a memfd, and is answered with a frame of the same kind holding a
+//4-byte exit status, the 8-byte run time in microseconds and the captured output, all big-endian.
+//A client may send several requests before reading, they are answered in order. Answers a client
+//is not reading yet are queued and sent from the event loop when its socket becomes writable.
+#define SERVE_REQUEST_MAX (1024*1024) // longer requests close the connection
+#define SERVE_BACKLOG_MAX (64*1024*1024) // unsent answer bytes that close the connection
+struct serve_client {
+	int id, fd;
+	struct out_buf input; // requests not run yet
+	struct out_buf output; // answers not sent yet
+	bool watching_write; // EPOLLOUT is on while output is queued
+	bool closing; // sent exit, closed once its answers are sent
+};
+struct serve_client **serve_clients=NULL;
+int serve_client_count=0, serve_client_capacity=0;
+int serve_fd=-1; // listening socket
+char serve_path[108]; // sizeof(sun_path)
+int serve_output_fd=-1; // memfd holding the output of the running request
+struct serve_client *serve_client_find(int id)
+{
+	for (int i=0;i<serve_client_count;++i)
+		if (serve_clients[i]->id==id)
+			return serve_clients[i];
+	return NULL;
+}
+void serve_client_close(struct serve_client *client)
+{
+	for (int i=0;i<serve_client_count;++i)
+		if (serve_clients[i]==client)
+		{
+			memmove(serve_clients+i, serve_clients+i+1, sizeof(struct serve_client *)*(serve_client_count-i-1));
+			serve_client_count--;
+			break;
+		}
+	event_remove(client->fd);
+	close(client->fd);
+	free(client->input.data);
+	free(client->output.data);
+	free(client);
+}
+/**
+ * Starts listening, a socket left behind by a shell that is gone is replaced
+ * @return false with errno set on error
+ */
+bool serve_start(const char *path)
+{
+	struct sockaddr_un address={.sun_family=AF_UNIX};
+	if (strlen(path)>=sizeof(address.sun_path))
+	{
+		errno=ENAMETOOLONG;
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	int fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd==-1)
+		return false;
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address))==0)
+	{
+		close(fd);
+		errno=EADDRINUSE;
+		return false;
+	}
+	struct stat st;
+	if (errno==ECONNREFUSED && stat(path, &st)==0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	close(fd);
+	fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	mode_t mask=umask(077); // anyone who can connect can run commands as this user
+	int r=bind(fd, (struct sockaddr *)&address, sizeof(address));
+	umask(mask);
+	if (r==-1 || listen(fd, 64)==-1)
+	{
+		int error=errno;
+		close(fd);
+		errno=error;
+		return false;
+	}
+	if (serve_output_fd==-1)
+		serve_output_fd=memfd_create("seashell-serve", MFD_CLOEXEC);
+	serve_fd=fd;
+	strcpy(serve_path, path);
+	event_add(serve_fd, EVENT_SERVE, 0);
+	return true;
+}
+/**
+ * Stops accepting connections, connected clients are served until they hang up
+ */
+void serve_stop()
+{
+	if (serve_fd==-1)
+		return;
+	event_remove(serve_fd);
+	close(serve_fd);
+	unlink(serve_path);
+	serve_fd=-1;
+}
+void serve_accept()
+{
+	int fd;
+	while (serve_fd!=-1 && (fd=accept4(serve_fd, NULL, NULL, SOCK_CLOEXEC|SOCK_NONBLOCK))!=-1)
+	{
+		struct serve_client *client=calloc(1, sizeof(struct serve_client));
+		client->fd=fd;
+		client->id=1;
+		while (serve_client_find(client->id))
+			client->id++;
+		if (serve_client_count==serve_client_capacity)
+		{
+			serve_client_capacity=serve_client_capacity ? serve_client_capacity*2 : 8;
+			serve_clients=realloc(serve_clients, sizeof(struct serve_client *)*serve_client_capacity);
+		}
+		serve_clients[serve_client_count++]=client;
+		event_add(fd, EVENT_CLIENT, client->id);
+	}
+}
+/**
+ * Sends as much of a client's queued answers as its socket takes without blocking, and waits
+ * for it to become writable while some are left
+ * @return false if the connection failed
+ */
+bool serve_send(struct serve_client *client)
+{
+	size_t sent=0;
+	while (sent<client->output.len)
+	{
+		ssize_t n=send(client->fd, client->output.data+sent, client->output.len-sent, MSG_NOSIGNAL);
+		if (n==-1 && errno==EINTR)
+			continue;
+		if (n==-1 && errno==EAGAIN)
+			break;
+		if (n<=0)
+			return false;
+		sent+=n;
+	}
+	memmove(client->output.data, client->output.data+sent, client->output.len-sent);
+	client->output.len-=sent;
+	bool pending=client->output.len>0;
+	if (pending!=client->watching_write)
+		event_watch_write(client->fd, EVENT_CLIENT, client->id, pending);
+	client->watching_write=pending;
+	return true;
+}
+void serve_flush(int id)
+{
+	struct serve_client *client=serve_client_find(id);
+	if (client && (!serve_send(client) || (client->closing && client->output.len==0)))
+		serve_client_close(client);
+}
+/**
+ * Runs one request with its output captured
+ * @param  line     command line
+ * @param  response the response frame is appended here
+ * @return          EXIT when the request was exit, which closes the connection
+ */
+int serve_run(char *line, struct out_buf *response)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fflush(stdout);
+	//a request can arrive while the prompt waits for a key, commands get the terminal as a typed line would
+	bool raw=prompt_raw_mode;
+	if (raw)
+		tcsetattr(STDIN_FILENO, TCSANOW, &prompt_cooked_termios);
+	ftruncate(serve_output_fd, 0);
+	lseek(serve_output_fd, 0, SEEK_SET);
+	int saved[3], null_fd=open("/dev/null", O_RDONLY|O_CLOEXEC);
+	for (int i=0;i<3;++i)
+		saved[i]=fcntl(i, F_DUPFD_CLOEXEC, 10);
+	dup2(null_fd, STDIN_FILENO);
+	dup2(serve_output_fd, STDOUT_FILENO);
+	dup2(serve_output_fd, STDERR_FILENO);
+	close(null_fd);
+
+	struct command_t *command=calloc(1, sizeof(struct command_t));
+	parse_command(line, command);
+	expand_command(command);
+	last_status=0;
+	int code=process_command(command);
+	free_command(command);
+	int status=code==UNKNOWN ? 127 : last_status;
+
+	fflush(stdout);
+	for (int i=0;i<3;++i)
+	{
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	if (raw)
+		tcsetattr(STDIN_FILENO, TCSANOW, &prompt_raw_termios);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t elapsed=(end.tv_sec-start.tv_sec)*1000000+(end.tv_nsec-start.tv_nsec)/1000;
+	off_t size=lseek(serve_output_fd, 0, SEEK_END);
+	if (size<0)
+		size=0;
+	uint32_t header[2]={htonl(12+size), htonl(status)};
+	uint64_t time=htobe64(elapsed);
+	out_append(response, (const char *)header, sizeof(header));
+	out_append(response, (const char *)&time, sizeof(time));
+	if (response->len+size>response->capacity)
+	{
+		response->capacity=(response->len+size)*2;
+		response->data=realloc(response->data, response->capacity);
+	}
+	if (pread(serve_output_fd, response->data+response->len, size, 0)!=size)
+		memset(response->data+response->len, 0, size);
+	response->len+=size;
+	return code;
+}
+/**
+ * Reads what a client has sent and answers every complete request
+ */
+void serve_read(int id)
+{
+	struct serve_client *client=serve_client_find(id);
+	if (!client)
+		return;
+	char buf[65536];
+	ssize_t n;
+	while ((n=recv(client->fd, buf, sizeof(buf), 0))>0)
+		out_append(&client->input, buf, n);
+	bool hangup=n==0 || (n==-1 && errno!=EAGAIN && errno!=EINTR);
+	size_t at=0, queued=client->output.len;
+	bool close_client=hangup;
+	while (!client->closing && client->input.len-at>=4)
+	{
+		uint32_t length;
+		memcpy(&length, client->input.data+at, 4);
+		length=ntohl(length);
+		if (length>SERVE_REQUEST_MAX)
+		{
+			close_client=true;
+			break;
+		}
+		if (client->input.len-at-4<length)
+			break;
+		char *line=malloc(length+1);
+		memcpy(line, client->input.data+at+4, length);
+		line[length]=0;
+		line[strcspn(line, "\n")]=0; // one line per request, like the prompt
+		at+=4+length;
+		int code=serve_run(line, &client->output);
+		free(line);
+		if (code==EXIT)
+			client->closing=true;
+	}
+	memmove(client->input.data, client->input.data+at, client->input.len-at);
+	client->input.len-=at;
+	//a client that hung up after sending still had its requests run, it just gets no answer
+	if (!close_client && client->output.len>queued && (!serve_send(client) || client->output.len>SERVE_BACKLOG_MAX))
+		close_client=true;
+	if (close_client || (client->closing && client->output.len==0))
+		serve_client_close(client);
+}
+/**
+ * Starts or stops the control socket
+ * @param command serve PATH | serve -f PATH | serve stop | serve
+ */
+void serve_run_builtin(struct command_t *command)
+{
+	if (command->arg_count==0)
+	{
+		if (serve_fd==-1)
+			printf("not serving\n");
+		else
+			printf("serving on %s, %d client%s connected\n", serve_path, serve_client_count,
+				serve_client_count==1 ? "" : "s");
+		return;
+	}
+	if (strcmp(command->args[0], "stop")==0)
+	{
+		serve_stop();
+		return;
+	}
+	//-f serves without a prompt until the socket is stopped and every client has hung up
+	bool foreground=command->arg_count==2 && strcmp(command->args[0], "-f")==0;
+	if (command->arg_count!=1 && !foreground)
+	{
+		printf("-%s: serve: usage: serve [-f] path | serve stop\n", sysname);
+		return;
+	}
+	if (serve_fd!=-1)
+	{
+		printf("-%s: serve: already serving on %s\n", sysname, serve_path);
+		return;
+	}
+	const char *path=command->args[foreground ? 1 : 0];
+	if (!serve_start(path))
+	{
+		printf("-%s: serve: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+	if (!foreground)
+		return;
+	fflush(stdout);
+	event_remove(STDIN_FILENO); // typed input waits for the prompt instead of waking the loop
+	while (event_fd!=-1 && (serve_fd!=-1 || serve_client_count>0))
+		event_dispatch(-1);
+	if (event_input_pollable)
+		event_add(STDIN_FILENO, EVENT_INPUT, 0);
+}
+
+//in-shell scheduler behind at, every, sched and goodMorning: jobs sit in a min-heap ordered by their
+//next run time and a single timerfd is armed at absolute wall-clock time for the earliest one.
+//Recurring jobs are rescheduled from their previous due time, not from when they ran, so they never drift.
+struct sched_job {
+	int id;
+	char *command_line;
+	time_t next; // next run time
+	long interval; // seconds between runs, 0 for a one-shot job
+};
+struct sched_job **sched_heap=NULL;
+int sched_count=0, sched_capacity=0, sched_next_id=1;
+int sched_timer_fd=-1;
+void sched_swap(int a, int b)
+{
+	struct sched_job *job=sched_heap[a];
+	sched_heap[a]=sched_heap[b];
+	sched_heap[b]=job;
+}
+void sched_sift_up(int i)
+{
+	while (i>0 && sched_heap[(i-1)/2]->next>sched_heap[i]->next)
+	{
+		sched_swap(i, (i-1)/2);
+		i=(i-1)/2;
+	}
+}
+void sched_sift_down(int i)
+{
+	while (1)
+	{
+		int smallest=i, left=2*i+1, right=2*i+2;
+		if (left<sched_count && sched_heap[left]->next<sched_heap[smallest]->next) smallest=left;
+		if (right<sched_count && sched_heap[right]->next<sched_heap[smallest]->next) smallest=right;
+		if (smallest==i)
+			return;
+		sched_swap(i, smallest);
+		i=smallest;
+	}
+}
+void sched_push(struct sched_job *job)
+{
+	if (sched_count==sched_capacity)
+	{
+		sched_capacity=sched_capacity ? sched_capacity*2 : 16;
+		sched_heap=realloc(sched_heap, sizeof(struct sched_job *)*sched_capacity);
+	}
+	sched_heap[sched_count++]=job;
+	sched_sift_up(sched_count-1);
+}
+struct sched_job *sched_remove(int i)
+{
+	struct sched_job *job=sched_heap[i];
+	sched_heap[i]=sched_heap[--sched_count];
+	if (i<sched_count)
+	{
+		sched_sift_up(i);
+		sched_sift_down(i);
+	}
+	return job;
+}
+/**
+ * Arms the timer for the earliest job, or disarms it when there is none
+ */
+void sched_arm()
+{
+	if (sched_timer_fd==-1)
+	{
+		sched_timer_fd=timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+		event_add(sched_timer_fd, EVENT_TIMER, 0);
+	}
+	struct itimerspec spec={{0, 0}, {0, 0}};
+	if (sched_count>0)
+		spec.it_value.tv_sec=sched_heap[0]->next>0 ? sched_heap[0]->next : 1;
+	timerfd_settime(sched_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+/**
+ * Starts a command line as a background job that is not announced
+ */
+void sched_spawn(const char *command_line)
+{
+	struct command_t *command=calloc(1, sizeof(struct command_t));
+	char *buf=strdup(command_line);
+	parse_command(buf, command);
+	expand_command(command);
+	job_start(command, false); // its output is printed above the prompt like any background job
+	free_command(command);
+	free(buf);
+}
+/**
+ * Runs every job that is due and re-arms the timer, called when the timerfd fires
+ */
+void sched_run_due()
+{
+	uint64_t expirations;
+	read(sched_timer_fd, &expirations, sizeof(expirations));
+	time_t now=time(NULL);
+	while (sched_count>0 && sched_heap[0]->next<=now)
+	{
+		struct sched_job *job=sched_remove(0);
+		sched_spawn(job->command_line);
+		if (job->interval>0)
+		{
+			//runs missed while the shell was busy are skipped, the phase is kept
+			job->next+=((now-job->next)/job->interval+1)*job->interval;
+			sched_push(job);
+		}
+		else
+		{
+			free(job->command_line);
+			free(job);
+		}
+	}
+	sched_arm();
+}
+/**
+ * Adds a job
+ * @return the job id
+ */
+int sched_add(time_t next, long interval, const char *command_line)
+{
+	struct sched_job *job=malloc(sizeof(struct sched_job));
+	job->id=sched_next_id++;
+	job->command_line=strdup(command_line);
+	job->next=next;
+	job->interval=interval;
+	sched_push(job);
+	sched_arm();
+	return job->id;
+}
+/**
+ * Parses an interval like 90, 90s, 15m, 2h or 1d
+ * @return seconds, -1 if invalid
+ */
+long sched_parse_interval(const char *s)
+{
+	char *end;
+	long value=strtol(s, &end, 10);
+	if (end==s || value<=0)
+		return -1;
+	if (*end==0 || strcmp(end, "s")==0) return value;
+	if (strcmp(end, "m")==0) return value*60;
+	if (strcmp(end, "h")==0) return value*3600;
+	if (strcmp(end, "d")==0) return value*86400;
+	return -1;
+}
+/**
+ * Parses a time of day like 7.30 or 07:30 (or +interval) into its next occurrence
+ * @return the time, -1 if invalid
+ */
+time_t sched_parse_time(const char *s)
+{
+	time_t now=time(NULL);
+	if (s[0]=='+')
+	{
+		long interval=sched_parse_interval(s+1);
+		return interval==-1 ? -1 : now+interval;
+	}
+	int hour, minute;
+	char separator, extra;
+	if (sscanf(s, "%d%c%d%c", &hour, &separator, &minute, &extra)!=3 || (separator!='.' && separator!=':')
+		|| hour<0 || hour>23 || minute<0 || minute>59)
+		return -1;
+	struct tm when;
+	localtime_r(&now, &when);
+	when.tm_hour=hour;
+	when.tm_min=minute;
+	when.tm_sec=0;
+	when.tm_isdst=-1;
+	time_t next=mktime(&when);
+	if (next<=now)
+	{
+		when.tm_mday++;
+		when.tm_isdst=-1;
+		next=mktime(&when);
+	}
+	return next;
+}
+/**
+ * Joins arguments back into a command line
+ */
+char *join_args(char **args, int count)
+{
+	size_t len=1;
+	for (int i=0;i<count;++i)
+		len+=strlen(args[i])+1;
+	char *line=malloc(len);
+	line[0]=0;
+	for (int i=0;i<count;++i)
+	{
+		if (i) strcat(line, " ");
+		strcat(line, args[i]);
+	}
+	return line;
+}
+
+//memo: caches the stdout, stderr and exit status of deterministic commands in ~/.seashell_memo.
+//The key covers the arguments, the working directory, the -e environment variables and the mtime
+//and size of the -f files and of every argument naming a file. Outputs are stored once per content
+//in objects/, entries/<key hash> point at them; the least recently used entries are evicted past
+//MEMO_MAX_BYTES and unreferenced objects are removed with them.
+#define MEMO_MAX_BYTES (256L*1024*1024)
+void memo_key_add(char **key, size_t *len, const char *part)
+{
+	size_t part_len=strlen(part)+1; // the NUL separates the parts
+	*key=realloc(*key, *len+part_len);
+	memcpy(*key+*len, part, part_len);
+	*len+=part_len;
+}
+void memo_key_add_file(char **key, size_t *len, const char *path)
+{
+	struct stat st;
+	char part[4200];
+	if (stat(path, &st)==0)
+		snprintf(part, sizeof(part), "file=%s:%lld:%ld.%09ld", path, (long long)st.st_size,
+			(long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	else
+		snprintf(part, sizeof(part), "file=%s:missing", path);
+	memo_key_add(key, len, part);
+}
+/**
+ * Names a blob after its content: two 64-bit hashes and its size
+ */
+void memo_object_name(int fd, char *name, size_t size)
+{
+	size_t len;
+	bool mapped;
+	char *data=fastutil_load(fd, &len, &mapped);
+	snprintf(name, size, "%016llx%016llx-%zu", (unsigned long long)fnv1a(data, len),
+		(unsigned long long)fnv1a_continue(0x9e3779b97f4a7c15ULL, data, len), len);
+	fastutil_release(data, len, mapped);
+}
+/**
+ * Compares two files byte for byte
+ */
+bool memo_same_content(const char *a, const char *b)
+{
+	int fd_a=open(a, O_RDONLY|O_CLOEXEC), fd_b=open(b, O_RDONLY|O_CLOEXEC);
+	size_t len_a=0, len_b=0;
+	bool mapped_a=false, mapped_b=false;
+	char *data_a=fd_a!=-1 ? fastutil_load(fd_a, &len_a, &mapped_a) : NULL;
+	char *data_b=fd_b!=-1 ? fastutil_load(fd_b, &len_b, &mapped_b) : NULL;
+	bool same=fd_a!=-1 && fd_b!=-1 && len_a==len_b && (len_a==0 || memcmp(data_a, data_b, len_a)==0);
+	fastutil_release(data_a, len_a, mapped_a);
+	fastutil_release(data_b, len_b, mapped_b);
+	if (fd_a!=-1) close(fd_a);
+	if (fd_b!=-1) close(fd_b);
+	return same;
+}
+/**
+ * Moves a captured output into the object store. An object with the same name is only
+ * shared when its bytes match, a colliding one gets the next free .N suffix.
+ */
+void memo_store_object(const char *dir, const char *tmp_path, char *name, size_t size)
+{
+	int fd=open(tmp_path, O_RDONLY|O_CLOEXEC);
+	if (fd==-1)
+	{
+		snprintf(name, size, "-");
+		return;
+	}
+	memo_object_name(fd, name, size);
+	close(fd);
+	size_t base_len=strlen(name);
+	char path[4200];
+	for (int suffix=0;;++suffix)
+	{
+		if (suffix>0)
+			snprintf(name+base_len, size-base_len, ".%d", suffix);
+		snprintf(path, sizeof(path), "%s/objects/%s", dir, name);
+		if (access(path, F_OK)!=0)
+		{
+			rename(tmp_path, path);
+			return;
+		}
+		if (memo_same_content(path, tmp_path))
+		{
+			remove(tmp_path); // same content already stored
+			return;
+		}
+	}
+}
+struct memo_entry_info {
+	char name[NAME_MAX+1];
+	time_t used;
+	char refs[2][128]; // out and err objects
+	long long size; // bytes of its objects
+};
+int memo_compare_used(const void *a, const void *b)
+{
+	time_t x=((const struct memo_entry_info *)a)->used, y=((const struct memo_entry_info *)b)->used;
+	return x<y ? -1 : x>y;
+}
+/**
+ * Evicts the least recently used entries once the objects take more than MEMO_MAX_BYTES,
+ * down to three quarters of it, then removes the objects no entry refers to any more.
+ * Called with the store lock held exclusively.
+ */
+void memo_evict(const char *dir)
+{
+	char path[4200];
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	DIR *objects=opendir(path);
+	snprintf(path, sizeof(path), "%s/entries", dir);
+	DIR *entries=opendir(path);
+	if (objects==NULL || entries==NULL)
+	{
+		if (objects) closedir(objects);
+		if (entries) closedir(entries);
+		return;
+	}
+	long long total=0;
+	struct dirent *ent;
+	struct stat st;
+	while ((ent=readdir(objects))!=NULL)
+		if (ent->d_name[0]!='.' && fstatat(dirfd(objects), ent->d_name, &st, 0)==0)
+			total+=st.st_size;
+	struct memo_entry_info *infos=NULL;
+	int count=0, capacity=0;
+	while (total>MEMO_MAX_BYTES && (ent=readdir(entries))!=NULL)
+	{
+		if (ent->d_name[0]=='.' || fstatat(dirfd(entries), ent->d_name, &st, 0)!=0)
+			continue;
+		if (count==capacity)
+		{
+			capacity=capacity ? capacity*2 : 64;
+			infos=realloc(infos, sizeof(struct memo_entry_info)*capacity);
+		}
+		struct memo_entry_info *info=&infos[count++];
+		memset(info, 0, sizeof(*info));
+		snprintf(info->name, sizeof(info->name), "%s", ent->d_name);
+		info->used=st.st_mtime;
+		int fd=openat(dirfd(entries), ent->d_name, O_RDONLY|O_CLOEXEC);
+		FILE *f=fd!=-1 ? fdopen(fd, "r") : NULL;
+		char *line=NULL;
+		size_t cap=0;
+		ssize_t n;
+		while (f && (n=getline(&line, &cap, f))!=-1)
+		{
+			int ref=strncmp(line, "out ", 4)==0 ? 0 : strncmp(line, "err ", 4)==0 ? 1 : -1;
+			if (ref==-1)
+				continue;
+			if (line[n-1]=='\n') line[n-1]=0;
+			snprintf(info->refs[ref], sizeof(info->refs[ref]), "%s", line+4);
+			if (fstatat(dirfd(objects), line+4, &st, 0)==0)
+				info->size+=st.st_size;
+		}
+		free(line);
+		if (f) fclose(f);
+	}
+	if (count==0)
+	{
+		closedir(objects);
+		closedir(entries);
+		return;
+	}
+	qsort(infos, count, sizeof(struct memo_entry_info), memo_compare_used);
+	int evicted=0;
+	for (;evicted<count && total>MEMO_MAX_BYTES*3/4;++evicted)
+	{
+		unlinkat(dirfd(entries), infos[evicted].name, 0);
+		total-=infos[evicted].size;
+	}
+	rewinddir(objects);
+	while ((ent=readdir(objects))!=NULL)
+	{
+		if (ent->d_name[0]=='.')
+			continue;
+		bool used=false;
+		for (int i=evicted;i<count && !used;++i)
+			used=strcmp(infos[i].refs[0], ent->d_name)==0 || strcmp(infos[i].refs[1], ent->d_name)==0;
+		if (!used)
+			unlinkat(dirfd(objects), ent->d_name, 0);
+	}
+	free(infos);
+	closedir(entries);
+	closedir(objects);
+}
+/**
+ * Replays a cached entry
+ * @return true on a hit
+ */
+bool memo_replay(const char *dir, const char *entry_path, const char *key, size_t key_len, int *status)
+{
+	FILE *f=fopen(entry_path, "r");
+	if (f==NULL)
+		return false;
+	//the entry starts with the full key, so a hash collision is a miss
+	size_t stored_len;
+	bool hit=fscanf(f, "key %zu\n", &stored_len)==1 && stored_len==key_len;
+	char *stored=hit ? malloc(key_len) : NULL;
+	hit=hit && fread(stored, 1, key_len, f)==key_len && memcmp(stored, key, key_len)==0;
+	free(stored);
+	char out[128], err[128];
+	hit=hit && fscanf(f, "\nstatus %d\nout %127s\nerr %127s\n", status, out, err)==3;
+	fclose(f);
+	if (!hit)
+		return false;
+	//both objects are opened before anything is written, a miss must not have printed half the output
+	char path[4200];
+	const char *names[2]={out, err};
+	int fds[2]={-1, -1};
+	for (int i=0;i<2;++i)
+	{
+		if (strcmp(names[i], "-")==0)
+			continue;
+		snprintf(path, sizeof(path), "%s/objects/%s", dir, names[i]);
+		fds[i]=open(path, O_RDONLY|O_CLOEXEC);
+		if (fds[i]==-1)
+		{
+			if (i==1 && fds[0]!=-1)
+				close(fds[0]);
+			return false; // evicted underneath
+		}
+	}
+	fflush(stdout);
+	for (int i=0;i<2;++i)
+		if (fds[i]!=-1)
+		{
+			copy_fd(fds[i], i==0 ? STDOUT_FILENO : STDERR_FILENO);
+			close(fds[i]);
+		}
+	utimensat(AT_FDCWD, entry_path, NULL, 0); // marks it recently used
+	return true;
+}
+/**
+ * memo [-e VAR]... [-f FILE]... command args...
+ * @return exit status of the command
+ */
+int memo_run(struct command_t *command)
+{
+	char **args=command->args;
+	int count=command->arg_count, first=0;
+	char *key=NULL;
+	size_t key_len=0;
+	char cwd[4096], part[8192];
+	if (getcwd(cwd, sizeof(cwd))==NULL)
+		cwd[0]=0;
+	snprintf(part, sizeof(part), "cwd=%s", cwd);
+	memo_key_add(&key, &key_len, part);
+	for (;first+1<count && (strcmp(args[first], "-e")==0 || strcmp(args[first], "-f")==0);first+=2)
+	{
+		if (args[first][1]=='e')
+		{
+			const char *value=getenv(args[first+1]);
+			snprintf(part, sizeof(part), "env=%s=%s%s", args[first+1], value ? "1" : "0", value ? value : "");
+			memo_key_add(&key, &key_len, part);
+		}
+		else
+			memo_key_add_file(&key, &key_len, args[first+1]);
+	}
+	if (first>=count)
+	{
+		printf("usage: memo [-e VAR]... [-f FILE]... command args...\n");
+		free(key);
+		return 1;
+	}
+	for (int i=first;i<count;++i)
+	{
+		struct stat st;
+		memo_key_add(&key, &key_len, args[i]);
+		if (i>first && stat(args[i], &st)==0 && S_ISREG(st.st_mode))
+			memo_key_add_file(&key, &key_len, args[i]);
+	}
+
+	char dir[512], path[4200], entry_path[4200];
+	home_path(dir, sizeof(dir), ".seashell_memo");
+	mkdir(dir, 0700);
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/entries", dir);
+	mkdir(path, 0700);
+	snprintf(entry_path, sizeof(entry_path), "%s/entries/%016llx%016llx", dir,
+		(unsigned long long)fnv1a(key, key_len),
+		(unsigned long long)fnv1a_continue(0x9e3779b97f4a7c15ULL, key, key_len));
+	int status=0;
+	if (memo_replay(dir, entry_path, key, key_len, &status))
+	{
+		free(key);
+		return status;
+	}
+
+	//miss: runs the command with its outputs captured
+	char out_tmp[4200], err_tmp[4200];
+	snprintf(out_tmp, sizeof(out_tmp), "%s/objects/.out.%d", dir, getpid());
+	snprintf(err_tmp, sizeof(err_tmp), "%s/objects/.err.%d", dir, getpid());
+	int out_fd=open(out_tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	int err_fd=open(err_tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	struct command_t inner={0};
+	inner.name=args[first];
+	inner.args=args+first+1;
+	inner.arg_count=count-first-1;
+	fflush(stdout);
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		dup2(out_fd, STDOUT_FILENO);
+		dup2(err_fd, STDERR_FILENO);
+		run_stage(&inner);
+	}
+	close(out_fd);
+	close(err_fd);
+	int wstatus=0;
+	if (pid>0)
+		waitpid(pid, &wstatus, 0);
+	status=WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+
+	//replays the captured output, then stores it unless the command was killed
+	const char *tmps[2]={out_tmp, err_tmp};
+	for (int i=0;i<2;++i)
+	{
+		int fd=open(tmps[i], O_RDONLY|O_CLOEXEC);
+		if (fd!=-1)
+		{
+			copy_fd(fd, i==0 ? STDOUT_FILENO : STDERR_FILENO);
+			close(fd);
+		}
+	}
+	if (pid>0 && WIFEXITED(wstatus))
+	{
+		//storing holds the lock shared, so the sweep cannot take an object whose entry is not in place yet
+		char out_name[128], err_name[128], entry_tmp[4300], lock_path[4200];
+		snprintf(lock_path, sizeof(lock_path), "%s/lock", dir);
+		int lock=lock_file(lock_path, LOCK_SH);
+		memo_store_object(dir, out_tmp, out_name, sizeof(out_name));
+		memo_store_object(dir, err_tmp, err_name, sizeof(err_name));
+		snprintf(entry_tmp, sizeof(entry_tmp), "%s.%d", entry_path, getpid());
+		FILE *f=fopen(entry_tmp, "w");
+		if (f!=NULL)
+		{
+			fprintf(f, "key %zu\n", key_len);
+			fwrite(key, 1, key_len, f);
+			fprintf(f, "\nstatus %d\nout %s\nerr %s\n", status, out_name, err_name);
+			if (fclose(f)==0)
+				rename(entry_tmp, entry_path);
+			else
+				remove(entry_tmp);
+		}
+		unlock_file(lock);
+		//another session storing or evicting right now, it can wait for the next miss
+		lock=lock_file(lock_path, LOCK_EX|LOCK_NB);
+		if (lock!=-1)
+			memo_evict(dir);
+		unlock_file(lock);
+	}
+	else
+	{
+		remove(out_tmp);
+		remove(err_tmp);
+	}
+	free(key);
+	return status;
+}
+#if !defined(SEASHELL_FUZZ) && !defined(SEASHELL_PARSE_BENCH)
+int main()
+{
+	setvbuf(stdin, NULL, _IONBF, 0); // nothing is left in a stdio buffer while polling the terminal
+	snapshot_open();
+	history_follow_init();
+	//the snapshot holds the newest entries as well, unless more are asked for
+	int preload=history_preload_count();
+	if (preload!=SNAPSHOT_HISTORY_ENTRIES || !snapshot_load_history())
+		history_preload(preload);
+	snapshot_refresh_background();
+	event_init();
+	while (1)
+	{
+		struct command_t *command=malloc(sizeof(struct command_t));
+		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+
+		int code;
+		code = prompt(command);
+		if (code==EXIT) break;
+
+		history_record(command);
+		expand_command(command);
+		code = process_command(command);
+		if (code==EXIT) break;
+
+		free_command(command);
+	}
+	serve_stop();
+
+	printf("\n");
+	return 0;
+}
+#endif
+
+int process_command(struct command_t *command)
+{
+	if (strcmp(command->name, "")==0) return SUCCESS;
+
+	if (command->next || command->background)
+		return run_pipeline(command);
+
+	//creates hist implementation 
+	if (strcmp(command->name, "hist")==0)
+   	{
+		//--json and --ndjson print the entries as records
+		enum json_mode json_mode=json_flag(command);
+		struct json_writer json;
+		json_begin(&json, json_mode);
+		struct json_writer *writer=json_mode!=JSON_OFF ? &json : NULL;
+        	if (command->arg_count > 0)
+        	{	
+			//prints all the history
+			if (strcmp(command->args[0], "all")==0){
+				history_query("all", NULL, writer);
+		   	//prints the history of the given user 
+		   	}else if (strcmp(command->args[0], "user")==0 && command->arg_count > 1){
+				history_query("user", command->args[1], writer);
+		   	//prints the history of the given date	
+		   	}else if (strcmp(command->args[0], "date")==0 && command->arg_count > 1){
+				history_query("date", command->args[1], writer);
+		   	//deletes all the history
+		   	}else if (strcmp(command->args[0], "clear")==0){
+				history_clear();
+		   	//prints the newest entries of all sessions picked up since this one started
+		   	}else if (strcmp(command->args[0], "recent")==0){
+				history_poll();
+				for (int i=0; i<history_recent_count; i++){
+					const char *line=history_recent[(history_recent_start+i)%HISTORY_RECENT_MAX];
+					if (writer)
+						history_json(writer, line);
+					else
+						printf("%s\n", line);
+				}
+		   	//merges and deduplicates the rotated segments
+		   	}else if (strcmp(command->args[0], "compact")==0){
+				history_compact();
+		   	//hist last [N]: the newest N (1) entries, read backwards from the end
+		   	}else if (strcmp(command->args[0], "last")==0){
+				history_print_last(command->arg_count > 1 ? atoi(command->args[1]) : 1, writer);
+		   	//hist tail [-f] [N]: the newest N (10) entries, with -f new ones as they are recorded
+		   	}else if (strcmp(command->args[0], "tail")==0){
+				bool follow=command->arg_count > 1 && strcmp(command->args[1], "-f")==0;
+				int count=command->arg_count > 1+follow ? atoi(command->args[1+follow]) : 10;
+				history_tail(count, follow, writer);
+			}
+        	}
+		if (writer)
+			json_end(writer);
+		if (command->arg_count > 0)
+			return SUCCESS;
+        	
+        }
+
+	//shopt lists or toggles shell options
+	if (strcmp(command->name, "shopt")==0)
+	{
+		if (command->arg_count == 0){
+			for (int i=0; i<SHELL_OPTION_COUNT; i++)
+				printf("%-12s %-3s %s\n", shell_options[i].name,
+					shell_options[i].enabled?"on":"off", shell_options[i].help);
+			return SUCCESS;
+		}
+		for (int i=0; i<SHELL_OPTION_COUNT; i++){
+			if (strcmp(shell_options[i].name, command->args[0])==0){
+				if (command->arg_count > 1)
+					shell_options[i].enabled = strcmp(command->args[1], "on")==0;
+				printf("%s %s\n", shell_options[i].name, shell_options[i].enabled?"on":"off");
+				return SUCCESS;
+			}
+		}
+		printf("-%s: %s: %s: invalid option name\n", sysname, command->name, command->args[0]);
+		return SUCCESS;
+	}
+	
+	int r;
+	if (strcmp(command->name, "exit")==0)
+		return EXIT;
+
+	if (strcmp(command->name, "cd")==0)
+	{
+		if (command->arg_count > 0)
+		{
+			r=chdir(command->args[0]);
+			if (r==-1)
+				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			else
+				dir_index_record(); //feeds shortdir jump
+			return SUCCESS;
+		}
+	}
+	
+	
+	
+	
+	//shortdir command implementation (Part II)
+	if (strcmp(command->name, "shortdir")==0)
+   	{
+        	if (command->arg_count > 0)
+        	{
+			char cwd[4096];
+			struct shortdir_map map = {0}; //name-directory associations
+			
+			//file created to store the associations
+			char path_shortdir[512];
+			home_path(path_shortdir, sizeof(path_shortdir), "shortdir");
+			//other sessions rewrite the file too, so the read-modify-write runs under the lock
+			char path_lock[512];
+			home_path(path_lock, sizeof(path_lock), ".shortdir.lock");
+			bool modifies = strcmp(command->args[0], "set")==0 || strcmp(command->args[0], "del")==0
+				|| strcmp(command->args[0], "clear")==0;
+			int lock = lock_file(path_lock, modifies ? LOCK_EX : LOCK_SH);
+			//a rewrite starts from the file itself, never from the snapshot
+			if (modifies || !snapshot_load_aliases(&map))
+				shortdir_load(&map, path_shortdir);
+	    
+	    	        //gets current directory	
+	    		if (getcwd(cwd, sizeof(cwd)) == NULL)
+	    			cwd[0] = 0;
+	    		
+			//sets a new name to the current directory
+			if (strcmp(command->args[0], "set")==0 && command->arg_count > 1){
+				int index = shortdir_find(map.values, map.count, cwd);
+				//if a name is already used, prints a warning
+				if(shortdir_find(map.keys, map.count, command->args[1])!=-1){
+					printf("%s alias already used\n", command->args[1]);
+				}
+				//if the same directory already has a name, replaces it
+				else if (index!=-1){
+					free(map.keys[index]);
+					map.keys[index] = strdup(command->args[1]);
+					printf("%s is set as an alias for %s\n", map.keys[index], map.values[index]);
+				//if the name and directory were not used before, adds them
+				}else{
+					shortdir_add(&map, command->args[1], cwd);
+					printf("%s is set as an alias for %s\n",
+						map.keys[map.count-1], map.values[map.count-1]);
+				}
+				
+			}
+			//changes to the directory of the name, or to the most frecent visited directory matching the fragments
+			if (strcmp(command->args[0], "jump")==0 && command->arg_count > 1){
+				int index = shortdir_find(map.keys, map.count, command->args[1]);
+				const char *target = index!=-1 ? map.values[index]
+					: dir_index_query(command->args+1, command->arg_count-1);
+				if (target == NULL)
+					printf("-%s: %s: no directory matches %s\n", sysname, command->name, command->args[1]);
+				else if (chdir(target)==-1)
+					printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+				else
+					dir_index_record();
+			}
+			//deletes the name-directory association of the given name
+			if (strcmp(command->args[0], "del")==0 && command->arg_count > 1){
+				int index = shortdir_find(map.keys, map.count, command->args[1]);
+				if (index!=-1)
+					shortdir_remove(&map, index);
+				else
+					printf("%s alias not found\n", command->args[1]);
+			}
+			//lists all name-directory associations
+			if (strcmp(command->args[0], "list")==0){
+				for(int i=0; i < map.count; i++){
+					printf("name: %s directory: %s\n", map.keys[i], map.values[i]);
+				}
+			}
+			//deletes all name-directory associations
+			if (strcmp(command->args[0], "clear")==0){
+				shortdir_free(&map);
+			}
+			
+			//writes the associations back to the file
+			if (modifies && shortdir_save(&map, path_shortdir)==-1)
+				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+	    		unlock_file(lock);
+	    		shortdir_free(&map);
+	    		return SUCCESS;
+
+       	}
+        	}
+        	
+        
+        
+        //goodMorning implementation (Part IV), plays the song every day at the given time
+	if (strcmp(command->name, "goodMorning")==0)
+    {
+        if (command->arg_count == 2)
+        {
+            char song[4096];
+            if(realpath(command->args[1], song)!=NULL){
+                time_t next = sched_parse_time(command->args[0]);
+                if (next == -1){
+                    printf("-%s: %s: %s: invalid time, use hour.minute\n", sysname, command->name, command->args[0]);
+                    return SUCCESS;
+                }
+                if (getenv("DISPLAY") == NULL)
+                    setenv("DISPLAY", ":0", 0);
+                char *line;
+                if (asprintf(&line, "rhythmbox-client --play '%s'", song) == -1)
+                    return SUCCESS;
+                int id = sched_add(next, 86400, line);
+                free(line);
+                printf("[%d] goodMorning at %s every day\n", id, command->args[0]);
+                return SUCCESS;
+            }else{
+                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+            }
+
+        }
+    }
+
+    //at time command..., every interval command... and sched list|cancel id
+    if (strcmp(command->name, "at")==0 || strcmp(command->name, "every")==0)
+    {
+        if (command->arg_count < 2){
+            printf("usage: at hour.minute|+interval command...\n       every interval[s|m|h|d] command...\n");
+            return SUCCESS;
+        }
+        bool recurring = strcmp(command->name, "every")==0;
+        long interval = recurring ? sched_parse_interval(command->args[0]) : 0;
+        time_t next = recurring ? time(NULL)+interval : sched_parse_time(command->args[0]);
+        if (interval == -1 || next == -1){
+            printf("-%s: %s: %s: invalid %s\n", sysname, command->name, command->args[0], recurring ? "interval" : "time");
+            return SUCCESS;
+        }
+        char *line = join_args(command->args+1, command->arg_count-1);
+        printf("[%d] %s\n", sched_add(next, interval, line), line);
+        free(line);
+        return SUCCESS;
+    }
+    if (strcmp(command->name, "sched")==0)
+    {
+        if (command->arg_count == 0 || strcmp(command->args[0], "list")==0){
+            for (int i=0; i<sched_count; i++){
+                char when[64];
+                strftime(when, sizeof(when), "%d/%m/%Y %X", localtime(&sched_heap[i]->next));
+                printf("[%d] %s", sched_heap[i]->id, when);
+                if (sched_heap[i]->interval)
+                    printf(" every %lds", sched_heap[i]->interval);
+                printf(" %s\n", sched_heap[i]->command_line);
+            }
+            return SUCCESS;
+        }
+        if (strcmp(command->args[0], "cancel")==0 && command->arg_count > 1){
+            int id = atoi(command->args[1]);
+            for (int i=0; i<sched_count; i++){
+                if (sched_heap[i]->id == id){
+                    struct sched_job *job = sched_remove(i);
+                    free(job->command_line);
+                    free(job);
+                    sched_arm();
+                    return SUCCESS;
+                }
+            }
+            printf("-%s: %s: %s: no such job\n", sysname, command->name, command->args[1]);
+            return SUCCESS;
+        }
+        printf("usage: sched [list] | sched cancel id\n");
+        return SUCCESS;
+    }
+    
+    //kdiff implementation (Part V)
+    //kdiff [--json|--ndjson] [-a|-b] file1 file2 | kdiff [--json|--ndjson] -r [-c] [-a|-b] dir1 dir2
+    if (strcmp(command->name, "kdiff")==0)
+    {
+        struct json_writer json;
+        json_begin(&json, json_flag(command));
+        struct json_writer *writer=json.mode!=JSON_OFF ? &json : NULL;
+        char mode=0;
+        bool recursive=false, contents=false;
+        int first=0;
+        for (; first<command->arg_count && command->args[first][0]=='-' && command->args[first][1]; first++)
+        {
+            if (strcmp(command->args[first], "-a")==0 || strcmp(command->args[first], "-b")==0)
+                mode=command->args[first][1];
+            else if (strcmp(command->args[first], "-r")==0)
+                recursive=true;
+            else if (strcmp(command->args[first], "-c")==0)
+                contents=true;
+            else
+            {
+                printf("-%s: %s: %s: invalid option\n", sysname, command->name, command->args[first]);
+                return SUCCESS;
+            }
+        }
+        if (command->arg_count-first!=2)
+        {
+            printf("usage: kdiff [--json|--ndjson] [-a|-b] file1 file2 | kdiff [--json|--ndjson] -r [-c] [-a|-b] dir1 dir2\n");
+            return SUCCESS;
+        }
+        const char *path1=command->args[first], *path2=command->args[first+1];
+        if (recursive)
+            kdiff_tree(path1, path2, mode, contents, writer);
+        else if (mode=='b') //binary comparison of two files
+        {
+            long dif=kdiff_bytes(path1, path2, writer);
+            if (writer && dif>=0)
+            {
+                struct json_out *out=json_record(writer);
+                json_string(out, "type", "summary", 7);
+                json_number(out, "different_bytes", dif);
+                json_record_end(writer);
+            }
+            else if (dif>0)
+                printf("The two files are different in %ld bytes\n", dif);
+            else if (dif==0)
+                printf("Files are identical\n");
+        }
+        else //line by line comparison, also when -a is not given
+        {
+            long dif=kdiff_lines(path1, path2, writer);
+            if (writer && dif>=0)
+            {
+                struct json_out *out=json_record(writer);
+                json_string(out, "type", "summary", 7);
+                json_number(out, "different_lines", dif);
+                json_record_end(writer);
+            }
+            else if (dif>0)
+                printf("%ld different lines are found\n", dif);
+            else if (dif==0)
+                printf("Files are identical\n");
+        }
+        if (writer)
+            json_end(writer);
+        return SUCCESS;
+    }
+    
+    //highlight implementation (Part III)
+    //highlight [--json|--ndjson] [-n] [-c] [-r] [-H] [-e] [-s|-i] [-w] word color [file|directory...]
+    if (strcmp(command->name, "highlight")==0){
+		struct highlight_options options = {0};
+		struct json_writer json;
+		json_begin(&json, json_flag(command)); // matches as records with their offsets and spans
+		if (json.mode != JSON_OFF)
+			options.json = &json;
+		int first = 0;
+		//reads the flags before the word
+		for (; first < command->arg_count && command->args[first][0]=='-' && command->args[first][1]; first++){
+			if (strcmp(command->args[first], "--")==0){
+				first++;
+				break;
+			}
+			for (char *flag = command->args[first]+1; *flag; flag++){
+				if (*flag=='n') options.line_numbers = true;
+				else if (*flag=='c') options.count_only = true;
+				else if (*flag=='r') options.recursive = true;
+				else if (*flag=='H') options.file_names = true;
+				else if (*flag=='e') options.regex = true;
+				else if (*flag=='s') options.case_sensitive = true;
+				else if (*flag=='i') options.case_sensitive = false;
+				else if (*flag=='w') options.whole_word = true;
+				else {
+					printf("-%s: %s: -%c: invalid option\n", sysname, command->name, *flag);
+					return SUCCESS;
+				}
+			}
+		}
+		
+		if (command->arg_count - first < 2){
+	           	printf("usage: highlight [--json|--ndjson] [-n] [-c] [-r] [-H] [-e] [-s|-i] [-w] word r|g|b [file...]\n");
+	           	return SUCCESS;
+	        }
+		options.word = command->args[first];
+		options.color = command->args[first+1];
+		//compiles the word once, plain words always match whole words
+		const char *error = matcher_compile(&options.matcher, options.word, options.regex,
+			!options.case_sensitive, options.whole_word || !options.regex);
+		if (error != NULL){
+			printf("-%s: %s: %s: %s\n", sysname, command->name, options.word, error);
+			matcher_free(&options.matcher);
+			return SUCCESS;
+		}
+		
+		//without files (or with -) it filters stdin
+		if (command->arg_count - first == 2 || (command->arg_count - first == 3 && strcmp(command->args[first+2], "-")==0))
+			highlight_stream(STDIN_FILENO, "(standard input)", &options);
+		else
+			highlight_files(command->args+first+2, command->arg_count-first-2, &options);
+		if (options.json)
+			json_end(options.json);
+		matcher_free(&options.matcher);
+		return SUCCESS;
+	}
+
+	//lists background jobs and prints the output they kept
+	if (strcmp(command->name, "jobs")==0)
+	{
+		jobs_run(command);
+		return SUCCESS;
+	}
+
+	//serves command lines from a Unix socket
+	if (strcmp(command->name, "serve")==0)
+	{
+		serve_run_builtin(command);
+		return SUCCESS;
+	}
+
+	//runs a command with resource limits, or sets the limits of every command
+	if (strcmp(command->name, "limit")==0)
+		return limit_run_builtin(command);
+
+	//replays cached output of deterministic commands instead of forking
+	if (strcmp(command->name, "memo")==0)
+	{
+		memo_run(command);
+		return SUCCESS;
+	}
+
+	//cat, wc, head and tail without fork and exec
+	if (shopt_enabled("fastutils") && fastutil_run(command))
+		return SUCCESS;
+
+	//forks, applies the limits in effect, execs and waits
+	return limit_run(command);
+}
+
+//parser harness, compiled instead of the shell's main:
+//  clang -g -fsanitize=fuzzer,address -DSEASHELL_FUZZ seashell.c -o parse_fuzz
+//  gcc -O2 -DSEASHELL_PARSE_BENCH seashell.c -o parse_bench && ./parse_bench [-h history.txt] [corpus...]
+//Both check the command structure parse_command builds, and compare its words with wordexp (POSIX
+//shell word splitting) for lines in the subset both understand the same way.
+#if defined(SEASHELL_FUZZ) || defined(SEASHELL_PARSE_BENCH)
+#include <wordexp.h>
+/**
+ * Whether a line is plain words separated by blanks, each but the command name optionally wrapped
+ * whole in quotes, with nothing a POSIX shell would expand or treat as an operator
+ */
+bool parse_reference_subset(const char *line)
+{
+	const char *plain="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._/,:=+@%-";
+	bool first=true;
+	for (const char *p=line;*p;)
+	{
+		if (*p==' ' || *p=='\t')
+		{
+			p++;
+			continue;
+		}
+		size_t len=strcspn(p, " \t");
+		if ((*p=='"' || *p=='\'') && !first)
+		{
+			if (len<2 || p[len-1]!=*p || strspn(p+1, plain)!=len-2)
+				return false;
+		}
+		else if (strspn(p, plain)!=len)
+			return false;
+		first=false;
+		p+=len;
+	}
+	return true;
+}
+/**
+ * Parses a line and checks the result
+ * @return false if the structure is broken or its words differ from wordexp's
+ */
+bool parse_check(const char *line)
+{
+	size_t len=strlen(line);
+	char *buf=malloc(len+1);
+	memcpy(buf, line, len+1);
+	struct command_t *command=calloc(1, sizeof(struct command_t));
+	parse_command(buf, command);
+	bool ok=true;
+	for (struct command_t *stage=command;stage;stage=stage->next)
+	{
+		ok=ok && stage->name!=NULL && stage->arg_count>=0 && (stage->arg_count==0 || stage->args!=NULL);
+		for (int i=0;ok && i<stage->arg_count;++i)
+			ok=stage->args[i]!=NULL;
+	}
+	wordexp_t words;
+	if (ok && parse_reference_subset(line) && wordexp(line, &words, WRDE_NOCMD|WRDE_UNDEF)==0)
+	{
+		if (words.we_wordc==0)
+			ok=command->name[0]==0 && command->arg_count==0;
+		else
+		{
+			ok=words.we_wordc==command->arg_count+1 && strcmp(words.we_wordv[0], command->name)==0;
+			for (int i=0;ok && i<command->arg_count;++i)
+				ok=strcmp(words.we_wordv[i+1], command->args[i])==0;
+		}
+		wordfree(&words);
+	}
+	free_command(command);
+	free(buf);
+	return ok;
+}
+#endif
+#ifdef SEASHELL_FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *line=malloc(size+1);
+	memcpy(line, data, size);
+	line[size]=0;
+	line[strcspn(line, "\n")]=0; // the prompt hands over one line without its newline
+	if (!parse_check(line))
+	{
+		fprintf(stderr, "parse_command mismatch: <%s>\n", line);
+		abort();
+	}
+	free(line);
+	return 0;
+}
+#endif
+#ifdef SEASHELL_PARSE_BENCH
+/**
+ * Generates a command line from the syntax the parser handles: words, quoted words, redirects,
+ * pipes and a trailing &
+ */
+void parse_bench_generate(struct out_buf *line, unsigned *seed)
+{
+	const char *words[]={"ls", "-la", "grep", "foo", "src/main.c", "\"quoted\"", "'single'", "--color=auto",
+		"x", "/usr/local/bin", "a.txt", "kdiff", "highlight", "memo", "-n"};
+	const int word_count=sizeof(words)/sizeof(words[0]);
+	line->len=0;
+	int stages=1+rand_r(seed)%3;
+	for (int stage=0;stage<stages;++stage)
+	{
+		if (stage)
+			out_puts(line, " | ");
+		out_puts(line, words[rand_r(seed)%word_count]);
+		int args=rand_r(seed)%8;
+		for (int i=0;i<args;++i)
+		{
+			out_puts(line, " ");
+			int kind=rand_r(seed)%10;
+			if (kind==0)
+				out_puts(line, ">");
+			else if (kind==1)
+				out_puts(line, "<");
+			out_puts(line, words[rand_r(seed)%word_count]);
+		}
+	}
+	if (rand_r(seed)%5==0)
+		out_puts(line, " &");
+	out_append(line, "", 1);
+}
+double parse_bench_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec+now.tv_nsec/1e9;
+}
+int main(int argc, char **argv)
+{
+	char **lines=NULL;
+	int count=0, capacity=0;
+	size_t bytes=0;
+	//corpus files hold one command line per line, -h takes the commands out of a history file
+	for (int i=1;i<argc;++i)
+	{
+		bool history=strcmp(argv[i], "-h")==0 && i+1<argc;
+		struct reader reader;
+		if (!reader_open(&reader, argv[history ? ++i : i]))
+		{
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+		char *line;
+		size_t len;
+		while (reader_line(&reader, &line, &len))
+		{
+			if (count==capacity)
+			{
+				capacity=capacity ? capacity*2 : 1024;
+				lines=realloc(lines, sizeof(char *)*capacity);
+			}
+			lines[count]=strdup(history ? history_line_command(line) : line);
+			bytes+=strlen(lines[count++]);
+		}
+		reader_close(&reader);
+	}
+	if (count==0)
+	{
+		unsigned seed=1;
+		struct out_buf line={0};
+		capacity=count=100000;
+		lines=malloc(sizeof(char *)*count);
+		for (int i=0;i<count;++i)
+		{
+			parse_bench_generate(&line, &seed);
+			lines[i]=strdup(line.data);
+			bytes+=line.len-1;
+		}
+		free(line.data);
+	}
+	int mismatches=0;
+	for (int i=0;i<count;++i)
+		if (!parse_check(lines[i]) && mismatches++<10)
+			printf("mismatch: <%s>\n", lines[i]);
+	printf("%d lines, %d differ from wordexp\n", count, mismatches);
+
+	//parses the corpus repeatedly for about a second, copying each line as the prompt would
+	char *buf=malloc(4096);
+	size_t buf_size=4096;
+	long parsed=0;
+	double start=parse_bench_now(), elapsed;
+	size_t parsed_bytes=0;
+	do
+	{
+		for (int i=0;i<count;++i)
+		{
+			size_t len=strlen(lines[i]);
+			if (len+1>buf_size)
+				buf=realloc(buf, buf_size=len+1);
+			memcpy(buf, lines[i], len+1);
+			struct command_t *command=calloc(1, sizeof(struct command_t));
+			parse_command(buf, command);
+			free_command(command);
+			parsed_bytes+=len;
+		}
+		parsed+=count;
+		elapsed=parse_bench_now()-start;
+	} while (elapsed<1.0);
+	printf("%.0f lines/s, %.1f MB/s\n", parsed/elapsed, parsed_bytes/elapsed/1e6);
+	for (int i=0;i<count;++i)
+		free(lines[i]);
+	free(lines);
+	free(buf);
+	return mismatches>0;
 }
+#endif